@@ -45,7 +45,7 @@ typedef std::list<NetAddress> AddressList;
 typedef std::map<NetAddress, Socket *> PeerMap;
 typedef std::pair<NetAddress, Socket *> Peer;
 
-Socket *FindPeer( const NetAddress &addr );
+Socket *FindPeer( const NetAddress &addr ); // Buddy.cpp's, unlocked. everything else uses Socket::FindPeer
 
 extern unsigned short LocalPort;
 extern const char *BuddyDir;
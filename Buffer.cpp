@@ -0,0 +1,85 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "Buffer.h"
+
+Mutex SharedBuffer::_PoolMutex[BUFFER_POOL_CLASSES];
+SharedBuffer *SharedBuffer::_Pool[BUFFER_POOL_CLASSES];
+int SharedBuffer::_PoolCount[BUFFER_POOL_CLASSES];
+
+SharedBuffer *SharedBuffer::Alloc( size_t size )
+{
+	int c = 0;
+	
+	while ( c < BUFFER_POOL_CLASSES && ( (size_t)1 << ( c + BUFFER_POOL_MIN_SHIFT ) ) < size )
+		c++;
+	
+	if ( c >= BUFFER_POOL_CLASSES )
+		return new SharedBuffer( new char[size], size, -1 );
+	
+	SharedBuffer *buf = NULL;
+	
+	_PoolMutex[c].Lock();
+	
+	if ( _Pool[c] )
+	{
+		buf = _Pool[c];
+		_Pool[c] = buf->_Next;
+		_PoolCount[c]--;
+	}
+	
+	_PoolMutex[c].Unlock();
+	
+	if ( buf )
+	{
+		buf->_Refs = 1;
+		return buf;
+	}
+	
+	size = (size_t)1 << ( c + BUFFER_POOL_MIN_SHIFT );
+	
+	return new SharedBuffer( new char[size], size, c );
+}
+
+SharedBuffer *SharedBuffer::Adopt( char *data, size_t size )
+{
+	return new SharedBuffer( data, size, -1 );
+}
+
+void SharedBuffer::Free( SharedBuffer *buf )
+{
+	int c = buf->_Class;
+	
+	if ( c >= 0 )
+	{
+		_PoolMutex[c].Lock();
+		
+		if ( (size_t)( _PoolCount[c] + 1 ) * buf->_Size <= BUFFER_POOL_BYTES || _PoolCount[c] < 2 )
+		{
+			buf->_Next = _Pool[c];
+			_Pool[c] = buf;
+			_PoolCount[c]++;
+			buf = NULL;
+		}
+		
+		_PoolMutex[c].Unlock();
+	}
+	
+	delete buf;
+}
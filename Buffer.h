@@ -0,0 +1,71 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __BUFFER_H_
+#define __BUFFER_H_
+
+#include <stddef.h>
+
+#include "Mutex.h"
+
+#define BUFFER_POOL_MIN_SHIFT 8 // smallest pooled size class, 256 bytes
+#define BUFFER_POOL_MAX_SHIFT 21 // largest pooled size class, 2 MB, enough for any frame
+#define BUFFER_POOL_CLASSES ( BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1 )
+#define BUFFER_POOL_BYTES (4*1024*1024) // free memory each size class hangs on to
+
+// a reference counted block of memory, so a socket can hang on to a slice of
+// file data while it sits in the send queue instead of copying it into a packet,
+// and a PacketReader can borrow a frame straight out of a socket's read buffer.
+// blocks up to 2 MB come from a pool of power of two size classes.
+class SharedBuffer
+{
+public:
+	static SharedBuffer *Alloc( size_t size ); // Size() may come back bigger than asked for
+	static SharedBuffer *Adopt( char *data, size_t size ); // takes over a new[]'d block
+	
+	SharedBuffer *Ref() { __sync_fetch_and_add( &_Refs, 1 ); return this; }
+	void Release() { if ( __sync_sub_and_fetch( &_Refs, 1 ) == 0 ) Free( this ); }
+	
+	bool IsShared() const { return _Refs > 1; }
+	
+	char *Data() { return _Data; }
+	size_t Size() const { return _Size; }
+
+private:
+	explicit SharedBuffer( char *data, size_t size, int sizeClass ) : _Data( data ), _Size( size ), _Class( sizeClass ), _Refs( 1 ), _Next( NULL ) {}
+	~SharedBuffer() { delete[] _Data; }
+	
+	// not copyable
+	SharedBuffer( const SharedBuffer & );
+	SharedBuffer &operator=( const SharedBuffer & );
+	
+	static void Free( SharedBuffer *buf );
+	
+	static Mutex _PoolMutex[BUFFER_POOL_CLASSES];
+	static SharedBuffer *_Pool[BUFFER_POOL_CLASSES]; // free lists, chained through _Next
+	static int _PoolCount[BUFFER_POOL_CLASSES];
+	
+	char *_Data;
+	size_t _Size;
+	int _Class; // -1 if not pooled
+	volatile int _Refs;
+	SharedBuffer *_Next;
+};
+
+#endif
@@ -18,6 +18,7 @@
 */
 
 #include <vector>
+#include <algorithm>
 
 using std::vector;
 
@@ -29,10 +30,14 @@ using std::vector;
 #include "Socket.h"
 #include "Clique.h"
 #include "FileSystem.h"
+#include "Stats.h"
+#include "Log.h"
 
 #include "drm.h"
 
 vector<Clique *> Clique::_Cliques;
+Clique *Clique::_Handlers[256];
+Clique::RouteMap Clique::_Routes;
 Mutex Clique::_GlobalMutex;
 
 void Clique::Connected( Socket *sock )
@@ -47,23 +52,89 @@ void Clique::Connected( Socket *sock )
 
 bool Clique::HandleReceive( Socket *sock, PacketReader &reader )
 {
+	Clique *c = NULL;
+	int cmd = reader.Command();
+	
+	reader.Seek( PacketReader::PAYLOAD_BEGIN ); // back to the begining
+	
 	_GlobalMutex.Lock();
-	vector<Clique*> cliques = _Cliques;
+	RouteMap::iterator iter = _Routes.find( reader.RequestID() );
+	if ( iter != _Routes.end() && iter->second.cmd == cmd )
+		c = iter->second.clique;
 	_GlobalMutex.Unlock();
 	
-	for ( vector<Clique*>::iterator iter = cliques.begin(); iter != cliques.end(); iter++ )
+	if ( c && c->OnReceive( sock, reader ) )
+		return true;
+	
+	_GlobalMutex.Lock();
+	c = _Handlers[ cmd & 0xFF ];
+	_GlobalMutex.Unlock();
+	
+	reader.Seek( PacketReader::PAYLOAD_BEGIN );
+	
+	if ( c && c->OnReceive( sock, reader ) )
+		return true;
+	
+	if ( IsFileCommand( cmd ) )
 	{
-		Clique *c = *iter;
-
-		reader.Seek( PacketReader::PAYLOAD_BEGIN ); // back to the begining
-			
-		if ( c->OnReceive( sock, reader ) )
+		char path[MAX_PATH];
+		
+		reader.Seek( PacketReader::PAYLOAD_BEGIN );
+		reader.ReadASCII( path, MAX_PATH );
+		
+		FSObject *obj = FileSystem::FindObject( path );
+		
+		reader.Seek( PacketReader::PAYLOAD_BEGIN );
+		
+		if ( obj && obj->IsFile() && ((File*)obj)->GetClique()->OnReceive( sock, reader ) )
 			return true;
 	}
 
 	return false;
 }
 
+bool Clique::IsFileCommand( int cmd )
+{
+	switch ( cmd )
+	{
+		case OPEN_REQ:
+		case READ_REQ:
+		case DRM_REQ:
+		case RENAME:
+		case UPDATE_DRM:
+			return true; // payload starts with the path of the file
+			
+		default:
+			return false;
+	}
+}
+
+void Clique::RegisterCommand( int cmd, Clique *c )
+{
+	_GlobalMutex.Lock();
+	_Handlers[ cmd & 0xFF ] = c;
+	_GlobalMutex.Unlock();
+}
+
+void Clique::AddRoute( int reqID, int cmd, Clique *c )
+{
+	Route route;
+	
+	route.cmd = cmd;
+	route.clique = c;
+	
+	_GlobalMutex.Lock();
+	_Routes[ reqID ] = route;
+	_GlobalMutex.Unlock();
+}
+
+void Clique::RemoveRoute( int reqID )
+{
+	_GlobalMutex.Lock();
+	_Routes.erase( reqID );
+	_GlobalMutex.Unlock();
+}
+
 void Clique::ChangeAddr( const NetAddress &from, const NetAddress &to )
 {
 	_GlobalMutex.Lock();
@@ -92,6 +163,16 @@ void Clique::Disconnected( Socket *sock )
 		(*iter)->OnDisconnect( sock );
 }
 
+void Clique::Drained( Socket *sock )
+{
+	Alpha.OnDrained( sock ); // only the alpha ever streams anything big enough to care
+}
+
+void Clique::Identified( Socket *sock )
+{
+	Alpha.OnIdentified( sock );
+}
+
 Clique::Clique()
 {
 	_GlobalMutex.Lock();
@@ -114,6 +195,20 @@ Clique::~Clique()
 		}
 	}
 	
+	for(int i=0;i<256;i++)
+	{
+		if ( _Handlers[i] == this )
+			_Handlers[i] = NULL;
+	}
+	
+	for(RouteMap::iterator iter = _Routes.begin(); iter != _Routes.end(); )
+	{
+		if ( iter->second.clique == this )
+			_Routes.erase( iter++ );
+		else
+			iter++;
+	}
+	
 	_GlobalMutex.Unlock();
 }
 
@@ -165,13 +260,11 @@ int Clique::Broadcast( Packet &p )
 	{
 		Unlock();
 		
-		Socket *sock = FindPeer( *iter );
+		Socket *sock = Socket::FindPeer( *iter );
 		
-		if ( sock )
-		{
-			sock->Send( p );
+		// members that are too far behind miss out rather than queueing without bound
+		if ( sock && sock->Writable() && sock->Send( p ) )
 			count++;
-		}
 		
 		Lock();
 	}
@@ -189,7 +282,7 @@ bool Clique::SendOnce( Packet &p )
 	{
 		Unlock();
 		
-		Socket *sock = FindPeer( *iter );
+		Socket *sock = Socket::FindPeer( *iter );
 		
 		if ( sock )
 		{
@@ -239,8 +332,13 @@ int Clique::NumberOfMembers()
 
 
 
-AlphaClique::AlphaClique() : _Initing( false ), _IsAlpha( true ), _Local( FindPeer( Socket::LocalAddr() ) )
+AlphaClique::AlphaClique() : _Initing( false ), _IsAlpha( true ), _Local( Socket::FindPeer( Socket::LocalAddr() ) ), _LeaseCount( 0 )
 {
+	static const int commands[] = { MAKE_ALPHA, ALPHA_CHUNK, HANDSHAKE, HANDSHAKE_RESP, LOCAL_FILES, LIST_REQ, CREATE_REQ, CREATE_RESP,
+		FS_REQ, FILE_UPDATE, RM_DIR, RM_FILE, FORWARD_REQ, RENAME, LEASE_BREAK };
+	
+	for(unsigned int i=0;i<sizeof(commands)/sizeof(commands[0]);i++)
+		RegisterCommand( commands[i], this );
 }
 
 AlphaClique::~AlphaClique()
@@ -291,7 +389,7 @@ int AlphaClique::ThreadMain()
 	for(AddressList::iterator iter = _Members.begin(); iter != _Members.end(); iter++)
 	{
 		Unlock();
-		if ( FindPeer( *iter ) != NULL )
+		if ( Socket::FindPeer( *iter ) != NULL )
 		{
 			_Initing = false;
 			return 0;
@@ -326,15 +424,24 @@ void AlphaClique::AddMember( const NetAddress &addr )
 }
 
 
-void AlphaClique::OnConnect( Socket *sock )
+void AlphaClique::OnIdentified( Socket *sock )
 {
 	if ( ThisIsAlpha() )
-	{		
-		if ( Peers.size() > 15 )
+	{
+		Lock();
+		StreamMap::iterator iter = _Streams.find( sock->Addr() );
+		bool resume = iter != _Streams.end();
+		if ( resume )
+			iter->second.gone = 0;
+		Unlock();
+		
+		if ( resume ) // they dropped off halfway through the tree
 		{
-			Packet p( MAKE_ALPHA );
-			FileSystem::WriteFullList( p );
-			sock->Send( p );
+			PumpTree( sock );
+		}
+		else if ( Socket::PeerCount() > 15 )
+		{
+			SendTree( sock );
 			AddMember(sock->Addr());
 		}
 	}
@@ -342,22 +449,40 @@ void AlphaClique::OnConnect( Socket *sock )
 
 void AlphaClique::OnDisconnect( Socket *sock )
 {
+	time_t now = time(NULL);
+	
+	// a stream waits a little for its peer to come back and pick it up again, after that it's forgotten
+	Lock();
+	for ( StreamMap::iterator iter = _Streams.begin(); iter != _Streams.end(); )
+	{
+		if ( iter->first == sock->Addr() )
+			iter->second.gone = now;
+		
+		if ( iter->second.gone && iter->second.gone + ALPHA_STREAM_LINGER < now )
+			_Streams.erase( iter++ );
+		else
+			iter++;
+	}
+	Unlock();
+	
 	if ( IsMember( sock->Addr() ) )
 	{
 		if ( !ThisIsAlpha() )
 		{
+			FileSystem::DropLeases(); // whoever takes over doesn't know what it's promised us
+			
 			if ( !_Initing )
 				StartThread();
 		}
 		else
 		{
-			for ( PeerMap::iterator iter = Peers.begin(); iter != Peers.end(); iter++ )
+			vector<Peer> peers = Socket::PeerList();
+			
+			for ( vector<Peer>::iterator iter = peers.begin(); iter != peers.end(); iter++ )
 			{
 				if ( iter->second != NULL && iter->second != sock && !IsMember( iter->first ) )
 				{
-					Packet p( MAKE_ALPHA );
-					FileSystem::WriteFullList( p );
-					iter->second->Send( p );
+					SendTree( iter->second );
 					
 					AddMember( iter->first );
 					
@@ -370,113 +495,362 @@ void AlphaClique::OnDisconnect( Socket *sock )
 	}
 }
 
-bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
+void AlphaClique::OnDrained( Socket *sock )
 {
-	switch ( reader.Command() )
+	Lock();
+	bool streaming = _Streams.find( sock->Addr() ) != _Streams.end();
+	Unlock();
+	
+	if ( streaming )
+		PumpTree( sock );
+}
+
+void AlphaClique::SendTree( Socket *sock )
+{
+	if ( sock->Protocol() >= 3 )
 	{
-		case MAKE_ALPHA:
+		Lock();
+		if ( _Streams.find( sock->Addr() ) == _Streams.end() )
 		{
-			AddMember( sock->Addr() );
-			Lock();
-			_IsAlpha = true;
-			for( AddressList::iterator iter = _Members.begin(); iter != _Members.end(); iter++ )
-			{
-				if ( FindPeer( *iter ) == NULL )
-					(new Socket())->Connect( *iter );
-			}
-			Unlock();
-			
-			while ( !reader.AtEnd() )
-			{
-				char name[MAX_PATH];
-				int type;
-
-				reader.ReadASCII( name, MAX_PATH );
-				type = reader.ReadByte();
+			TreeStream &s = _Streams[sock->Addr()];
+			s.busy = false;
+			s.gone = 0;
+		}
+		Unlock();
+		
+		PumpTree( sock );
+		return;
+	}
+	
+	Packet p( MAKE_ALPHA );
+	
+	if ( sock->Protocol() >= 2 )
+	{
+		EntryWriter entries( p );
+		
+		p.WriteShort( PACKET_V2_MARK );
+		FileSystem::WriteFullList( entries );
+	}
+	else
+	{
+		FileSystem::WriteFullList( p );
+	}
+	
+	sock->Send( p );
+}
 
-				mode_t mode = reader.ReadUnsignedInt();
-				time_t mtime = reader.ReadUnsignedInt();
-				time_t ctime = reader.ReadUnsignedInt();
+void AlphaClique::PumpTree( Socket *sock )
+{
+	Lock();
+	StreamMap::iterator iter = _Streams.find( sock->Addr() );
+	if ( iter == _Streams.end() || iter->second.busy )
+	{
+		Unlock();
+		return;
+	}
+	
+	iter->second.busy = true;
+	string cursor = iter->second.cursor;
+	Unlock();
+	
+	// the tree is walked again from the cursor every time, so nothing but the path is held between chunks
+	TreeWalker walker( cursor );
+	int limit = min( ALPHA_CHUNK_SIZE, sock->MaxFrame() - MAX_PATH - 1024 );
+	bool done = false;
+	
+	while ( !done && sock->Writable() && sock->Queued() < ALPHA_STREAM_WINDOW )
+	{
+		Packet p( ALPHA_CHUNK, 0, limit + 1024 );
+		EntryWriter entries( p ); // every chunk stands on its own, a lost connection never leaves half a dictionary behind
+		
+		int flags = p.Tell();
+		p.WriteByte( 0 );
+		
+		string path;
+		FSObject *obj = NULL;
+		
+		while ( p.Length() < limit && ( obj = walker.Next( path ) ) != NULL )
+		{
+			entries.Write( obj, path );
+			cursor = path;
+		}
+		
+		if ( obj == NULL )
+		{
+			int end = p.Tell();
+			p.Seek( flags );
+			p.WriteByte( ALPHA_CHUNK_LAST );
+			p.Seek( end );
+		}
+		
+		if ( !sock->Send( p ) )
+			break; // we'll hear from OnDrained again once there's room, and walk this chunk again from the cursor
+		
+		// only once the last chunk is actually on its way is the stream finished
+		if ( obj == NULL )
+		{
+			done = true;
+			break;
+		}
+		
+		Lock();
+		iter = _Streams.find( sock->Addr() );
+		if ( iter != _Streams.end() )
+			iter->second.cursor = cursor;
+		Unlock();
+	}
+	
+	Lock();
+	iter = _Streams.find( sock->Addr() );
+	if ( iter != _Streams.end() )
+	{
+		if ( done )
+			_Streams.erase( iter );
+		else
+			iter->second.busy = false;
+	}
+	Unlock();
+}
 
-				off_t size = 0;
-				AddressList list;
+void AlphaClique::BecomeAlpha( Socket *from )
+{
+	AddMember( from->Addr() );
+	Lock();
+	_IsAlpha = true;
+	for( AddressList::iterator iter = _Members.begin(); iter != _Members.end(); iter++ )
+	{
+		if ( Socket::FindPeer( *iter ) == NULL )
+			(new Socket())->Connect( *iter );
+	}
+	Unlock();
+}
 
-				if ( type == DT_REG )
+int AlphaClique::Grant( Socket *sock, const char *path )
+{
+	if ( !ThisIsAlpha() || IsMember( sock->Addr() ) )
+		return 0; // other alphas are told about every change anyway
+	
+	char key[MAX_PATH];
+	time_t now = time(NULL);
+	
+	FileSystem::Normalize( path, key );
+	
+	Lock();
+	
+	if ( _LeaseCount >= LEASE_MAX )
+	{
+		for ( LeaseMap::iterator iter = _Leases.begin(); iter != _Leases.end(); )
+		{
+			LeaseHolders &holders = iter->second;
+			
+			for ( LeaseHolders::iterator h = holders.begin(); h != holders.end(); )
+			{
+				if ( h->second < now )
 				{
-					size = reader.ReadUnsignedInt();
-
-					int c = reader.ReadInt();
-					for(int j=0;j<c;j++)
-						list.push_back( reader.ReadAddress() );
+					holders.erase( h++ );
+					_LeaseCount--;
 				}
-
-				FSObject *obj = FileSystem::AddObject( name, type );
-				if ( !obj )
-					obj = FileSystem::GetObject( name );
-
-				if ( !obj )
-					continue;
-
-				obj->Mode( mode );
-				obj->mTime( mtime );
-				obj->cTime( ctime );
-
-				if ( obj->IsFile() )
+				else
 				{
-					File *file = (File*)obj;
-
-					file->Size( size );
-
-					for ( AddressList::iterator iter = list.begin(); iter != list.end(); iter++ )
-						file->GetClique()->AddMember( *iter );
+					h++;
 				}
 			}
 			
-			return true;	
+			if ( holders.empty() )
+				_Leases.erase( iter++ );
+			else
+				iter++;
+		}
+	}
+	
+	if ( _LeaseCount >= LEASE_MAX )
+	{
+		Unlock();
+		return 0;
+	}
+	
+	LeaseHolders &holders = _Leases[key];
+	
+	if ( holders.find( sock->Addr() ) == holders.end() )
+		_LeaseCount++;
+	
+	holders[sock->Addr()] = now + LEASE_DURATION + LEASE_SLACK;
+	
+	Unlock();
+	
+	return LEASE_DURATION;
+}
+
+void AlphaClique::Revoke( const char *path, bool tree )
+{
+	if ( !ThisIsAlpha() )
+		return;
+	
+	char key[MAX_PATH];
+	int len = FileSystem::Normalize( path, key );
+	
+	Revoke( string( key, len ), key, tree );
+	
+	// the folder's listing carries path's attributes, so it goes too
+	char *slash = strrchr( key, '/' );
+	
+	if ( len > 1 )
+	{
+		*( slash == key ? slash + 1 : slash ) = 0;
+		Revoke( key, key, false );
+	}
+}
+
+void AlphaClique::Revoke( const string &key, const char *path, bool tree )
+{
+	AddressList holders;
+	time_t now = time(NULL);
+	string prefix = key == "/" ? key : key + "/";
+	
+	Lock();
+	
+	LeaseMap::iterator iter = _Leases.find( key );
+	if ( iter != _Leases.end() )
+	{
+		for ( LeaseHolders::iterator h = iter->second.begin(); h != iter->second.end(); h++ )
+		{
+			if ( h->second >= now )
+				holders.push_back( h->first );
 		}
 		
-		case HANDSHAKE:
+		_LeaseCount -= iter->second.size();
+		_Leases.erase( iter );
+	}
+	
+	// leases aren't kept by folder, so finding the ones under key means looking at all of them. folders are
+	// only renamed or removed every so often, and there are never more than LEASE_MAX
+	if ( tree )
+	{
+		for ( iter = _Leases.begin(); iter != _Leases.end(); )
 		{
-			int count = 0;
+			if ( iter->first.compare( 0, prefix.size(), prefix ) != 0 )
+			{
+				iter++;
+				continue;
+			}
 			
-			Packet p( HANDSHAKE_RESP );
-						
-			p.WriteShort( _Members.size() );
+			for ( LeaseHolders::iterator h = iter->second.begin(); h != iter->second.end(); h++ )
+			{
+				if ( h->second >= now && find( holders.begin(), holders.end(), h->first ) == holders.end() )
+					holders.push_back( h->first );
+			}
 			
-			p.WriteBool( ThisIsAlpha() );
+			_LeaseCount -= iter->second.size();
+			_Leases.erase( iter++ );
+		}
+	}
+	
+	Unlock();
+	
+	if ( holders.empty() )
+		return;
+	
+	// one break for path does for everything under it, the holder drops the lot
+	Packet p( LEASE_BREAK );
+	p.WriteASCII( path );
+	p.WriteBool( tree );
+	
+	for ( AddressList::iterator h = holders.begin(); h != holders.end(); h++ )
+	{
+		Socket *sock = Socket::FindPeer( *h );
+		
+		if ( sock )
+			sock->Send( p );
+	}
+}
+
+bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
+{
+	switch ( reader.Command() )
+	{
+		case ALPHA_CHUNK:
+		{
+			int flags = reader.ReadByte();
 			
-			Lock();
-			for(AddressList::iterator iter = _Members.begin(); iter != _Members.end(); iter++, count++)
-				p.WriteAddress( *iter );
-			Unlock();
+			FSEntry e;
+			EntryReader entries( reader );
 			
-			sock->Send( p );
+			while ( entries.Read( e ) )
+				FileSystem::ApplyEntry( e );
 			
+			if ( flags & ALPHA_CHUNK_LAST ) // we only take over once we have the whole tree
+				BecomeAlpha( sock );
 			
 			return true;
 		}
 		
-		case HANDSHAKE_RESP:
+		case MAKE_ALPHA:
 		{
-			int count = reader.ReadShort();
-			bool isAlpha = reader.ReadBool();
+			BecomeAlpha( sock );
 			
-			for(int i=0;i<count;i++)
-				AddMember( reader.ReadAddress() );
+			FSEntry e;
+			int start = reader.Tell();
 			
-			if ( !isAlpha ) // if they aren't an alpha then try from the list they gave us
+			if ( reader.ReadShort() == PACKET_V2_MARK )
 			{
-				sock->Close();
+				EntryReader entries( reader );
 				
-				if ( !_Initing )
-					StartThread();
+				while ( entries.Read( e ) )
+					FileSystem::ApplyEntry( e );
 			}
 			else
 			{
-				list<string> localFiles;
-				FileSystem::BuildList( localFiles );
-				
-				Packet p( LOCAL_FILES );
+				reader.Seek( start ); // a v1 body starts right in on the first path
+				
+				while ( EntryReader::ReadV1( reader, e ) )
+					FileSystem::ApplyEntry( e );
+			}
+			
+			return true;	
+		}
+		
+		case HANDSHAKE:
+		{
+			Packet p( HANDSHAKE_RESP );
+						
+			p.WriteShort( _Members.size() );
+			
+			p.WriteBool( ThisIsAlpha() );
+			
+			Lock();
+			p.WriteAddresses( _Members );
+			Unlock();
+			
+			sock->Send( p );
+			
+			
+			return true;
+		}
+		
+		case HANDSHAKE_RESP:
+		{
+			int count = reader.ReadShort();
+			bool isAlpha = reader.ReadBool();
+			
+			AddressList members;
+			reader.ReadAddresses( members, count );
+			
+			for ( AddressList::iterator iter = members.begin(); iter != members.end(); iter++ )
+				AddMember( *iter );
+			
+			if ( !isAlpha ) // if they aren't an alpha then try from the list they gave us
+			{
+				sock->Close();
+				
+				if ( !_Initing )
+					StartThread();
+			}
+			else
+			{
+				list<string> localFiles;
+				FileSystem::BuildList( localFiles );
+				
+				Packet p( LOCAL_FILES );
 				
 				p.WriteInt( localFiles.size() );
 				
@@ -510,7 +884,12 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 				if ( !file || !file->IsFile() )
 					continue;
 				
+				if ( file->GetClique()->IsMember( sock->Addr() ) )
+					continue;
+				
 				file->GetClique()->AddMember( sock->Addr() );
+				
+				Revoke( path ); // its member list is part of what clients were told about it
 			}
 			
 			return true;
@@ -523,6 +902,8 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			reader.ReadASCII( path, MAX_PATH );
 			
+			int version = reader.AtEnd() ? 1 : reader.ReadByte(); // newer peers ask for v2
+			
 			Folder *folder = (Folder*)FileSystem::GetObject( path );
 			if ( !folder )
 			{
@@ -532,20 +913,83 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			{
 				p.WriteShort( -ENOTDIR );
 			}
+			else if ( version >= 5 )
+			{
+				char after[MAX_PATH] = "";
+				
+				if ( !reader.AtEnd() )
+					reader.ReadASCII( after, MAX_PATH ); // name of the last entry they got, empty for the first page
+				
+				const FSList &files = folder->GetList();
+				FSListIter iter = after[0] ? folder->Locate( after ) : files.end();
+				
+				// if that entry has gone away we start over, entries are safe to resend
+				if ( iter != files.end() )
+					iter++;
+				else
+					iter = files.begin();
+				
+				int limit = min( LIST_PAGE_SIZE, sock->MaxFrame() - MAX_PATH - 1024 );
+				int count = 0;
+				const char *last = "";
+				
+				p.EnsureCapacity( limit + MAX_PATH + 1024 );
+				
+				EntryWriter entries( p );
+				
+				p.WriteShort( PACKET_V2_MARK );
+				
+				int countPos = p.Tell();
+				p.WriteShort( 0 );
+				
+				for( ; iter != files.end() && count < LIST_PAGE_ENTRIES && p.Length() < limit; iter++, count++ )
+				{
+					entries.Write( *iter, (*iter)->Name() );
+					last = (*iter)->Name();
+				}
+				
+				int end = p.Tell();
+				p.Seek( countPos );
+				p.WriteShort( count );
+				p.Seek( end );
+				
+				p.WriteUnsignedInt( Grant( sock, path ) );
+				p.WriteASCII( iter != files.end() ? last : "" ); // where the next page picks up, empty once that was all
+			}
+			else if ( version >= 2 )
+			{
+				const FSList &files = folder->GetList();
+				EntryWriter entries( p );
+				
+				p.WriteShort( PACKET_V2_MARK );
+				p.WriteShort( folder->Count() );
+				
+				for( FSListIter iter = files.begin(); iter != files.end(); iter++ )
+					entries.Write( *iter, (*iter)->Name() );
+				
+				if ( version >= 4 )
+					p.WriteUnsignedInt( Grant( sock, path ) );
+			}
 			else
 			{
-				FSList files = folder->GetList();
+				const FSList &files = folder->GetList();
+				
+				int size = p.Length() + 2;
+				for( FSListIter iter = files.begin(); iter != files.end(); iter++ )
+					size += FileSystem::EntrySize( *iter, strlen( (*iter)->Name() ) );
+				
+				p.EnsureCapacity( size );
 
-				p.WriteShort( files.size() );
+				p.WriteShort( folder->Count() );
 
-				for( FSList::iterator iter = files.begin(); iter != files.end(); iter++ )
+				for( FSListIter iter = files.begin(); iter != files.end(); iter++ )
 				{
 					FSObject *obj = *iter;
+					unsigned int attrs[3] = { obj->Mode(), (unsigned int)obj->mTime(), (unsigned int)obj->cTime() };
+					
 					p.WriteASCII( obj->Name() );
 					p.WriteByte( obj->Type() );
-					p.WriteUnsignedInt( obj->Mode() );
-					p.WriteUnsignedInt( obj->mTime() );
-					p.WriteUnsignedInt( obj->cTime() );
+					p.WriteUnsignedInts( attrs, 3 );
 				
 					if ( obj->IsFile() )
 					{
@@ -556,9 +1000,7 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 						AddressList list = file->GetClique()->Members();
 						
 						p.WriteInt( list.size() );
-						
-						for(AddressList::const_iterator iter = list.begin(); iter != list.end(); iter++)
-							p.WriteAddress( *iter );
+						p.WriteAddresses( list );
 					}
 				}
 			}
@@ -579,6 +1021,8 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			reader.ReadASCII( path, MAX_PATH );
 			
+			FileSystem::Appeared( path ); // even if it turns out to exist already, we were wrong to think it missing
+			
 			if ( !IsMember( sock->Addr() ) )
 			{
 				Packet p = reader.MakePacket();
@@ -604,6 +1048,8 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			if ( newObj->IsFile() )
 				((File*)newObj)->GetClique()->AddMember( sock->Addr() );
 			
+			Revoke( path );
+			
 			sock->Send( p );
 			
 			return true;
@@ -613,14 +1059,18 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 		{
 			NetAddress addr = reader.ReadAddress();
 			
+			// carries no path, so whatever we created could be anywhere
+			if ( addr == Socket::LocalAddr() )
+				FileSystem::Appeared();
+			
 			if ( addr != Socket::LocalAddr() )
 			{
-				PeerMap::iterator iter = Peers.find( addr );
+				Socket *fwd = Socket::FindPeer( addr );
 				
-				if ( iter != Peers.end() )
+				if ( fwd != NULL )
 				{
 					Packet p = reader.MakePacket();
-					iter->second->Send( p );
+					fwd->Send( p );
 					return true;
 				}
 			}
@@ -635,12 +1085,25 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			reader.ReadASCII( path, MAX_PATH );
 			
+			int version = reader.AtEnd() ? 1 : reader.ReadByte();
+			
 			FSObject *obj = FileSystem::GetObject( path );
 			
 			if ( !obj )
 			{
 				p.WriteShort( -ENOENT );
 			}
+			else if ( version >= 2 )
+			{
+				EntryWriter entries( p );
+				
+				p.WriteShort( PACKET_V2_MARK );
+				p.WriteShort( 1 );
+				entries.Write( obj, path );
+				
+				if ( version >= 4 )
+					p.WriteUnsignedInt( Grant( sock, path ) );
+			}
 			else 
 			{
 				p.WriteShort( 1 );
@@ -664,9 +1127,7 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 					AddressList list = file->GetClique()->Members();
 					
 					p.WriteInt( list.size() );
-					
-					for(AddressList::const_iterator iter = list.begin(); iter != list.end(); iter++)
-						p.WriteAddress( *iter );
+					p.WriteAddresses( list );
 				}
 			}
 			
@@ -689,11 +1150,15 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 				Broadcast( p );
 			}
 			
+			FileSystem::Appeared( path );
+			
 			newObj = FileSystem::GetObject( path );
 			if ( newObj != NULL && newObj->IsFile() )
 			{
 				newObj->mTime( mtime );
 				((File*)newObj)->Size( size );
+				
+				Revoke( path );
 			}
 			
 			return true;
@@ -718,6 +1183,8 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 				Broadcast( p );
 			}
 			
+			Revoke( path, obj->IsFolder() );
+			
 			FileSystem::RemoveObject( obj );
 			
 			return true;
@@ -730,7 +1197,7 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			if ( to == Socket::LocalAddr() )
 			{
-				if ( FindPeer( from ) == NULL )
+				if ( Socket::FindPeer( from ) == NULL )
 				{
 					Socket *sock = new Socket();
 					if ( !sock->Connect( from, true ) )
@@ -739,7 +1206,7 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 			}
 			else
 			{
-				Socket *fwd = FindPeer( to );
+				Socket *fwd = Socket::FindPeer( to );
 				if ( fwd != NULL )
 				{
 					Packet p = reader.MakePacket();
@@ -752,11 +1219,11 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 		
 		case RENAME:
 		{
-			char temp[MAX_PATH];
+			char from[MAX_PATH], to[MAX_PATH];
 			
-			reader.ReadASCII( temp, MAX_PATH );
+			reader.ReadASCII( from, MAX_PATH );
 			
-			FSObject *obj = FileSystem::GetObject( temp );
+			FSObject *obj = FileSystem::GetObject( from );
 			
 			if ( !obj )
 				return false;
@@ -767,9 +1234,26 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 				Broadcast( p );
 			}
 			
-			reader.ReadASCII( temp, MAX_PATH );
+			reader.ReadASCII( to, MAX_PATH );
+			
+			Revoke( from, obj->IsFolder() );
 			
-			obj->Move( temp );
+			obj->Move( to );
+			
+			Revoke( to );
+			
+			return true;
+		}
+		
+		case LEASE_BREAK:
+		{
+			char path[MAX_PATH];
+			
+			reader.ReadASCII( path, MAX_PATH );
+			
+			bool tree = !reader.AtEnd() && reader.ReadBool(); // older alphas only send the path
+			
+			FileSystem::BreakLease( path, tree );
 			
 			return true;
 		}
@@ -788,12 +1272,27 @@ bool AlphaClique::OnReceive( Socket *sock, PacketReader &reader )
 
 
 
-FileStorageClique::FileStorageClique( File *file ) : _File( file ), _DataID( 0 )
+int FileStorageClique::_Window = DATA_XFER_WINDOW;
+
+struct FileStorageClique::Block
+{
+	Block( off_t o, const NetAddress &f, const timeval &d ) : offset( o ), from( f ), due( d ) {}
+	
+	off_t offset; // asked for
+	NetAddress from; // who was asked
+	timeval due; // when we give up on them
+};
+
+FileStorageClique::FileStorageClique( File *file ) : _File( file ), _DataID( 0 ), _BlockSize( BUFF_BLOCK_SIZE ), _BlockTimer( this ), _NextBlock( 0 )
 {
 }
 
 FileStorageClique::~ FileStorageClique()
 {
+	_BlockTimer.Cancel();
+	
+	for ( unsigned int i = 0; i < _Asking.size(); i++ )
+		NetworkRequest::Unregister( _Asking[i] );
 }
 
 void FileStorageClique::JoinClique( bool sync )
@@ -801,7 +1300,7 @@ void FileStorageClique::JoinClique( bool sync )
 	Lock();
 	for(AddressList::iterator iter = _Members.begin(); iter != _Members.end(); iter++)
 	{
-		if ( FindPeer( *iter ) == NULL )
+		if ( Socket::FindPeer( *iter ) == NULL )
 		{
 			Unlock();
 			Socket *sock = new Socket();
@@ -821,6 +1320,84 @@ void FileStorageClique::JoinClique( bool sync )
 	Unlock();
 }
 
+int FileStorageClique::OpenRemote( int flags, NetAddress &source )
+{
+	vector<RequestFuture> asked;
+	AddressList members = Members();
+	vector<unsigned int> stale;
+	
+	// whatever is left from the last open can't tell us anything new
+	Lock();
+	stale.swap( _Asking );
+	Unlock();
+	
+	for ( unsigned int i = 0; i < stale.size(); i++ )
+		NetworkRequest::Unregister( stale[i] );
+	
+	for ( AddressList::iterator iter = members.begin(); iter != members.end(); iter++ )
+	{
+		Socket *sock = Socket::FindPeer( *iter );
+		
+		if ( sock == NULL || *iter == Socket::LocalAddr() )
+			continue;
+		
+		Packet p( OPEN_REQ );
+		p.WriteASCII( _File->FullPath().c_str() );
+		p.WriteInt( flags );
+		
+		NetworkRequest::Register( OPEN_RESP, p.RequestID() );
+		
+		if ( sock->Send( p ) )
+			asked.push_back( RequestFuture( p.RequestID() ) );
+		else
+			NetworkRequest::Unregister( p.RequestID() );
+	}
+	
+	int ret = -ENOENT;
+	
+	while ( !asked.empty() )
+	{
+		int i = RequestFuture::WaitAny( asked );
+		if ( i < 0 )
+			break;
+		
+		PacketReader reader = asked[i].Get();
+		
+		NetworkRequest::Unregister( asked[i].RequestID() );
+		asked.erase( asked.begin() + i );
+		
+		if ( !reader.IsValid() )
+			continue; // nothing to read after all
+		
+		int val = reader.ReadInt();
+		
+		if ( val > 0 ) // 0 is someone still downloading it themselves
+		{
+			source = reader.ReadAddress();
+			ret = val;
+			
+			Holder( source, val );
+			break;
+		}
+		
+		if ( val < 0 )
+			ret = val;
+	}
+	
+	// the rest can still join the swarm once they answer, but nobody waits on them
+	for ( unsigned int i = 0; i < asked.size(); i++ )
+	{
+		Ask( asked[i].RequestID() );
+		
+		PacketReader reader = asked[i].Get(); // anything that came in before the callback took over
+		
+		if ( reader.IsValid() )
+			OnLateOpen( reader, this );
+	}
+	
+	return ret;
+}
+
 bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 {
 	switch ( reader.Command() )
@@ -830,11 +1407,8 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 			char path[MAX_PATH];
 			int flags;
 			
-			reader.ReadASCII( path, MAX_PATH );
+			reader.ReadASCII( path, MAX_PATH ); // HandleReceive already matched the path to _File
 			flags = reader.ReadInt();
-
-			if ( FileSystem::GetObject( path ) != _File )
-				return false;
 			
 			Packet p( OPEN_RESP, reader.RequestID() );
 			
@@ -851,7 +1425,12 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 				
 				p.WriteAddress( Socket::LocalAddr() );
 				
-				AddMember( sock->Addr() );
+				if ( !IsMember( sock->Addr() ) )
+				{
+					AddMember( sock->Addr() );
+					
+					Alpha.Revoke( path ); // only does anything on the alpha, whose FS_RESPs carry our members
+				}
 			}
 			
 			sock->Send( p );
@@ -863,15 +1442,33 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 		{
 			char path[MAX_PATH];
 			int offset;
+			timeval start;
 			
-			reader.ReadASCII( path, MAX_PATH );
+			gettimeofday( &start, NULL );
 			
-			if ( FileSystem::GetObject( path ) != _File )
-				return false;
+			reader.ReadASCII( path, MAX_PATH );
 			
 			offset = reader.ReadUnsignedInt();
-						
-			int size = BUFF_BLOCK_SIZE;
+			
+			if ( !reader.AtEnd() && reader.ReadInt() != _File->Version() )
+			{
+				// an empty block tells a swarming downloader we hold some other version
+				Packet p( DATA_BLOCK, reader.RequestID() );
+				sock->Send( p );
+				return true;
+			}
+			
+			int size = BUFF_BLOCK_SIZE; // all older peers ever ask for
+			
+			if ( !reader.AtEnd() )
+			{
+				int limit = ( ( sock->MaxFrame() - PacketReader::PAYLOAD_BEGIN ) / BUFF_BLOCK_SIZE ) * BUFF_BLOCK_SIZE;
+				
+				size = reader.ReadInt();
+				
+				if ( size > limit )
+					size = limit;
+			}
 			
 			if ( offset+size > _File->_Size )
 				size = _File->_Size - offset;
@@ -880,26 +1477,26 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			if ( size > 0 && end <= _File->_Size )
 			{
-				int timeout = time(NULL) + 10 + (end - _File->_Recvd)/(1<<24);
-				while ( _File->_Downloading && _File->_Recvd < end && timeout > time(NULL) )
+				// we're still getting it ourselves. an empty block sends them elsewhere rather than holding up this thread
+				if ( _File->_Downloading && !_File->IsAvailable( offset, end ) )
 				{
-					// wait for the network to get the data we need
-					sched_yield();
-					usleep( 5 );
+					Packet p( DATA_BLOCK, reader.RequestID() );
+					sock->Send( p );
+					return true;
 				}
 				
-				if ( timeout <= time(NULL) )
-					return false;
-				
+				// pin the file's buffer and let the socket send straight out of it,
+				// a Flush() or new download swaps in a fresh buffer rather than touching this one
 				_File->Lock();
+				SharedBuffer *data = _File->PinData();
+				_File->Unlock();
 				
 				Packet p( DATA_BLOCK, reader.RequestID() );
-				p.EnsureCapacity( size + PacketReader::PAYLOAD_BEGIN );
-				p.WriteRaw( &_File->_Data[offset], size );
+				sock->Send( p, data, offset, size );
 				
-				_File->Unlock();
+				data->Release();
 				
-				sock->Send( p );
+				Stats::Serve( READ_REQ, start );
 			}
 			
 			return true;
@@ -907,39 +1504,87 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 		
 		case DATA_BLOCK:
 		{
-			if ( reader.RequestID() != _DataID || !_File->_Downloading )
+			vector<int> routes;
+			timeval now;
+			
+			gettimeofday( &now, NULL );
+			
+			Lock();
+			
+			BlockMap::iterator iter = _InFlight.find( reader.RequestID() );
+			if ( iter == _InFlight.end() || !_File->_Downloading )
+			{
+				Unlock();
 				return false;
+			}
+			
+			Block block = iter->second;
+			_InFlight.erase( iter );
+			routes.push_back( reader.RequestID() );
 			
 			int len = reader.Length() - PacketReader::PAYLOAD_BEGIN;
 			
-			if ( _File->_Recvd+len > _File->_Size )
-				len = _File->_Size - _File->_Recvd;
+			if ( block.offset+len > _File->_Size )
+				len = _File->_Size - block.offset;
+			
+			SourceMap::iterator src = _Sources.find( block.from );
+			bool stranded = false;
+			
+			if ( len > 0 )
+			{
+				if ( src != _Sources.end() )
+				{
+					src->second.inFlight--;
+					src->second.bytes += len;
+				}
+				
+				// a peer with a smaller frame limit hands back less than we asked for, get the rest again
+				if ( len < _BlockSize && block.offset + len < _File->_Size )
+					_Retry.push_back( block.offset + len );
+			}
+			else
+			{
+				// they don't have the version we want, let the rest of the swarm have their blocks
+				_Retry.push_back( block.offset );
+				_Holders.erase( block.from );
+				
+				if ( src != _Sources.end() )
+				{
+					DropSource( block.from, routes );
+					stranded = _Sources.empty();
+				}
+			}
+			
+			Unlock();
+			
+			for ( unsigned int i = 0; i < routes.size(); i++ )
+				RemoveRoute( routes[i] );
 			
 			if ( len > 0 )
 			{
 				_File->Lock();
 				
-				reader.ReadRaw( &_File->_Data[_File->_Recvd], len );
-				_File->_Recvd += len;
+				reader.ReadRaw( &_File->_Data[block.offset], len );
+				_File->MarkReceived( block.offset, block.offset+len );
 				
 				_File->Unlock();
+			}
 			
-				if ( _File->_Recvd < _File->_Size )
-				{
-					Packet p( READ_REQ );
-					
-					_DataID = p.RequestID();
-					
-					p.WriteASCII( _File->FullPath().c_str() );
-					p.WriteUnsignedInt( _File->_Recvd );
-					
-					sock->Send( p );
-				}
-				else
-				{
-					_File->_Downloading = false;
-					AddMember( Socket::LocalAddr() );
-				}
+			bool done = _File->_Recvd >= _File->_Size;
+			
+			if ( done )
+			{
+				CancelBlocks();
+				
+				_File->_Downloading = false;
+				AddMember( Socket::LocalAddr() );
+			}
+			else
+			{
+				if ( stranded )
+					FallBack( block.from );
+				
+				RequestBlocks();
 			}
 			
 			return true;
@@ -951,9 +1596,6 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			reader.ReadASCII( path, MAX_PATH );
 			
-			if ( FileSystem::GetObject( path ) != _File )
-				return false;
-			
 			Packet p( DRM_RESP, reader.RequestID() );
 			DRMManager->WriteDRM( _File, p );
 			
@@ -967,10 +1609,6 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 			char temp[MAX_PATH];
 			
 			reader.ReadASCII( temp, MAX_PATH );
-			
-			if ( FileSystem::GetObject( temp ) != _File )
-				return false;
-			
 			reader.ReadASCII( temp, MAX_PATH );
 			
 			_File->Move( temp );
@@ -984,9 +1622,6 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 			
 			reader.ReadASCII( temp, MAX_PATH );
 			
-			if ( FileSystem::GetObject( temp ) != _File )
-				return false;
-			
 			DRMManager->ReadDRM( _File, reader );
 			
 			return true;
@@ -999,8 +1634,41 @@ bool FileStorageClique::OnReceive( Socket *sock, PacketReader &reader )
 	}
 }
 
+void FileStorageClique::OnDisconnect( Socket *sock )
+{
+	vector<int> routes;
+	bool lost = false;
+	
+	Clique::OnDisconnect( sock );
+	
+	Lock();
+	
+	if ( _Sources.find( sock->Addr() ) != _Sources.end() )
+	{
+		DropSource( sock->Addr(), routes );
+		lost = true;
+	}
+	
+	bool stranded = lost && _Sources.empty();
+	
+	Unlock();
+	
+	for ( unsigned int i = 0; i < routes.size(); i++ )
+		RemoveRoute( routes[i] );
+	
+	if ( !lost || !_File->_Downloading )
+		return;
+	
+	if ( stranded )
+		FallBack( sock->Addr() );
+	
+	RequestBlocks();
+}
+
 void FileStorageClique::DownloadFrom( Socket *sock, int ver )
 {	
+	CancelBlocks();
+	
 	_File->Lock();
 	
 	_File->_Version = ver;
@@ -1009,20 +1677,382 @@ void FileStorageClique::DownloadFrom( Socket *sock, int ver )
 	
 	_File->_Recvd = 0;
 	_File->_LocalSize = _File->_Size;
-	_File->_Capacity = (_File->_Size/512 + 1)*512;
-	if ( _File->_Data )
-		delete[] _File->_Data;
-	_File->_Data = new char[_File->_Capacity];
+	_File->AllocData( (_File->_Size/512 + 1)*512 );
+	_File->_Blocks.assign( ( _File->_Size + BUFF_BLOCK_SIZE - 1 ) / BUFF_BLOCK_SIZE, false );
 	
-	Packet req( READ_REQ );
-	req.WriteASCII( _File->FullPath().c_str() );
-	req.WriteUnsignedInt( 0 );
+	_BlockSize = DATA_XFER_BLOCK;
+	if ( _BlockSize > sock->MaxFrame() - PacketReader::PAYLOAD_BEGIN )
+		_BlockSize = ( ( sock->MaxFrame() - PacketReader::PAYLOAD_BEGIN ) / BUFF_BLOCK_SIZE ) * BUFF_BLOCK_SIZE;
+	if ( _BlockSize < BUFF_BLOCK_SIZE )
+		_BlockSize = BUFF_BLOCK_SIZE;
 	
-	_DataID = req.RequestID();
+	bool empty = _File->_Size <= 0;
+	if ( empty )
+		_File->_Downloading = false;
 	
 	_File->Unlock();
 	
-	sock->Send( req );
+	if ( empty )
+	{
+		AddMember( Socket::LocalAddr() );
+		return;
+	}
+	
+	Lock();
+	_Holders[ sock->Addr() ] = ver;
+	Unlock();
+	
+	AddSource( sock );
+	
+	// only members that said they have all of it, one still downloading would just send empty blocks.
+	// every READ_REQ names the version anyway, so a holder that has moved on bows out
+	AddHolders( sock->Addr() );
+	
+	RequestBlocks();
+}
+
+void FileStorageClique::Holder( const NetAddress &addr, int ver )
+{
+	Lock();
+	_Holders[addr] = ver;
+	bool wanted = _File->_Downloading && ver == _File->_Version;
+	Unlock();
+	
+	Socket *sock = wanted ? Socket::FindPeer( addr ) : NULL;
+	
+	if ( sock )
+	{
+		AddSource( sock );
+		RequestBlocks();
+	}
+}
+
+bool FileStorageClique::AddHolders( const NetAddress &except )
+{
+	vector<NetAddress> addrs;
+	int added = 0;
+	
+	Lock();
+	for ( HolderMap::iterator iter = _Holders.begin(); iter != _Holders.end(); iter++ )
+	{
+		if ( iter->second == _File->_Version && iter->first != except && iter->first != Socket::LocalAddr() )
+			addrs.push_back( iter->first );
+	}
+	Unlock();
+	
+	for ( unsigned int i = 0; i < addrs.size(); i++ )
+	{
+		Socket *peer = Socket::FindPeer( addrs[i] );
+		
+		if ( peer )
+		{
+			AddSource( peer );
+			added++;
+		}
+	}
+	
+	return added > 0;
+}
+
+void FileStorageClique::FindSources()
+{
+	AddressList members = Members();
+	string path = _File->FullPath();
+	
+	for ( AddressList::iterator iter = members.begin(); iter != members.end(); iter++ )
+	{
+		Socket *sock = Socket::FindPeer( *iter );
+		
+		if ( sock == NULL || *iter == Socket::LocalAddr() )
+			continue;
+		
+		Packet p( OPEN_REQ );
+		p.WriteASCII( path.c_str() );
+		p.WriteInt( O_RDONLY );
+		
+		Ask( p.RequestID() );
+		
+		if ( !sock->Send( p ) )
+			NetworkRequest::Unregister( p.RequestID() );
+	}
+}
+
+void FileStorageClique::Ask( unsigned int reqID )
+{
+	Lock();
+	_Asking.push_back( reqID );
+	Unlock();
+	
+	NetworkRequest::Register( OPEN_RESP, reqID, OnLateOpen, this );
+}
+
+void FileStorageClique::OnLateOpen( PacketReader &resp, void *arg )
+{
+	FileStorageClique *c = (FileStorageClique *)arg;
+	
+	if ( !resp.IsValid() )
+		return; // timed out
+	
+	resp.Seek( PacketReader::PAYLOAD_BEGIN );
+	int val = resp.ReadInt();
+	
+	if ( val > 0 )
+		c->Holder( resp.ReadAddress(), val );
+	
+	// the id stays in _Asking, so ~FileStorageClique() still unregisters it and with that waits for us to get
+	// out of here. this is the last we touch c
+	NetworkRequest::Unregister( resp.RequestID() );
+}
+
+void FileStorageClique::AddSource( Socket *sock )
+{
+	Source src;
+	
+	src.inFlight = 0;
+	src.bytes = 0;
+	gettimeofday( &src.start, NULL );
+	
+	Lock();
+	
+	if ( _File->_Downloading && _Sources.find( sock->Addr() ) == _Sources.end() )
+		_Sources.insert( SourceMap::value_type( sock->Addr(), src ) );
+	
+	Unlock();
+}
+
+double FileStorageClique::Rate( const Source &src, const timeval &now )
+{
+	double elapsed = ( now.tv_sec - src.start.tv_sec ) + ( now.tv_usec - src.start.tv_usec ) / 1000000.0;
+	
+	if ( elapsed <= 0.001 || src.bytes <= 0 )
+		return 0;
+	
+	return src.bytes / elapsed;
+}
+
+void FileStorageClique::DropSource( const NetAddress &addr, vector<int> &routes )
+{
+	for ( BlockMap::iterator iter = _InFlight.begin(); iter != _InFlight.end(); )
+	{
+		if ( iter->second.from == addr )
+		{
+			_Retry.push_back( iter->second.offset );
+			routes.push_back( iter->first );
+			_InFlight.erase( iter++ );
+		}
+		else
+		{
+			iter++;
+		}
+	}
+	
+	_Sources.erase( addr );
+}
+
+// keep every source's window full, blocks go to whoever should get through one soonest and DATA_BLOCKs
+// may come back in any order
+void FileStorageClique::RequestBlocks()
+{
+	vector<Packet> reqs;
+	vector<Socket *> to;
+	vector<int> routes;
+	string path = _File->FullPath();
+	map<NetAddress, Socket *> socks;
+	timeval now, due;
+	double best = 0;
+	
+	gettimeofday( &now, NULL );
+	due = now;
+	due.tv_sec += DATA_XFER_TIMEOUT;
+	
+	Lock();
+	
+	for ( SourceMap::iterator iter = _Sources.begin(); iter != _Sources.end(); )
+	{
+		Socket *sock = Socket::FindPeer( iter->first );
+		
+		if ( sock == NULL )
+		{
+			NetAddress addr = iter->first;
+			iter++;
+			DropSource( addr, routes );
+			continue;
+		}
+		
+		socks[ iter->first ] = sock;
+		
+		if ( Rate( iter->second, now ) > best )
+			best = Rate( iter->second, now );
+		
+		iter++;
+	}
+	
+	while ( !_Retry.empty() || _NextBlock < _File->_Size )
+	{
+		SourceMap::iterator pick = _Sources.end();
+		double pickCost = 0;
+		
+		for ( SourceMap::iterator iter = _Sources.begin(); iter != _Sources.end(); iter++ )
+		{
+			double rate = Rate( iter->second, now );
+			
+			// slower peers get a window in proportion to their throughput so the fast ones aren't starved
+			int window = _Window;
+			if ( best > 0 && rate > 0 )
+				window = (int)( _Window * rate / best );
+			if ( window < 2 )
+				window = _Window < 2 ? _Window : 2;
+			
+			if ( iter->second.inFlight >= window )
+				continue;
+			
+			double cost = rate > 0 ? ( iter->second.inFlight + 1 ) / rate : iter->second.inFlight;
+			
+			if ( pick == _Sources.end() || cost < pickCost )
+			{
+				pick = iter;
+				pickCost = cost;
+			}
+		}
+		
+		if ( pick == _Sources.end() )
+			break;
+		
+		off_t offset;
+		
+		if ( !_Retry.empty() )
+		{
+			offset = _Retry.front();
+			_Retry.pop_front();
+		}
+		else
+		{
+			offset = _NextBlock;
+			_NextBlock += _BlockSize;
+		}
+		
+		Packet req( READ_REQ );
+		req.WriteASCII( path.c_str() );
+		req.WriteUnsignedInt( offset );
+		req.WriteInt( _File->_Version );
+		req.WriteInt( _BlockSize );
+		
+		_DataID = req.RequestID();
+		_InFlight.insert( BlockMap::value_type( _DataID, Block( offset, pick->first, due ) ) );
+		pick->second.inFlight++;
+		
+		reqs.push_back( req );
+		to.push_back( socks[ pick->first ] );
+	}
+	
+	Unlock();
+	
+	// routes take the global clique lock, which can't be taken while holding ours
+	for ( unsigned int i = 0; i < routes.size(); i++ )
+		RemoveRoute( routes[i] );
+	
+	for ( unsigned int i = 0; i < reqs.size(); i++ )
+	{
+		AddRoute( reqs[i].RequestID(), DATA_BLOCK, this );
+		to[i]->Send( reqs[i] );
+	}
+	
+	// already armed means something older is due first
+	if ( !reqs.empty() && !_BlockTimer.Pending() )
+		_BlockTimer.Schedule( DATA_XFER_TIMEOUT * 1000 );
+}
+
+void FileStorageClique::ExpireBlocks()
+{
+	vector<int> routes;
+	vector<NetAddress> late;
+	timeval now;
+	
+	gettimeofday( &now, NULL );
+	
+	Lock();
+	
+	for ( BlockMap::iterator iter = _InFlight.begin(); iter != _InFlight.end(); iter++ )
+	{
+		const timeval &due = iter->second.due;
+		
+		if ( ( due.tv_sec < now.tv_sec || ( due.tv_sec == now.tv_sec && due.tv_usec <= now.tv_usec ) ) &&
+			std::find( late.begin(), late.end(), iter->second.from ) == late.end() )
+			late.push_back( iter->second.from );
+	}
+	
+	// a source that sat on a block this long is gone as far as we're concerned, the rest of its blocks go too
+	for ( unsigned int i = 0; i < late.size(); i++ )
+	{
+		LOG( LOG_WARN, "Block from " << late[i] << " for " << _File->FullPath() << " timed out" );
+		DropSource( late[i], routes );
+	}
+	
+	bool stranded = !late.empty() && _Sources.empty();
+	
+	Unlock();
+	
+	for ( unsigned int i = 0; i < routes.size(); i++ )
+		RemoveRoute( routes[i] );
+	
+	if ( !_File->_Downloading )
+		return;
+	
+	if ( stranded )
+		FallBack( late.front() );
+	
+	RequestBlocks();
+	Arm();
+}
+
+void FileStorageClique::Arm()
+{
+	timeval now, next;
+	bool any = false;
+	
+	gettimeofday( &now, NULL );
+	
+	Lock();
+	
+	for ( BlockMap::iterator iter = _InFlight.begin(); iter != _InFlight.end(); iter++ )
+	{
+		const timeval &due = iter->second.due;
+		
+		if ( !any || due.tv_sec < next.tv_sec || ( due.tv_sec == next.tv_sec && due.tv_usec < next.tv_usec ) )
+			next = due;
+		any = true;
+	}
+	
+	Unlock();
+	
+	if ( any )
+		_BlockTimer.Schedule( ( next.tv_sec - now.tv_sec ) * 1000 + ( next.tv_usec - now.tv_usec ) / 1000 );
+}
+
+void FileStorageClique::FallBack( const NetAddress &except )
+{
+	// whoever else is connected and said they hold the file, failing that ask everyone again
+	if ( !AddHolders( except ) )
+		FindSources();
+}
+
+void FileStorageClique::CancelBlocks()
+{
+	BlockMap inFlight;
+	
+	Lock();
+	
+	inFlight.swap( _InFlight );
+	_Sources.clear();
+	_Retry.clear();
+	_NextBlock = 0;
+	
+	Unlock();
+	
+	for ( BlockMap::iterator iter = inFlight.begin(); iter != inFlight.end(); iter++ )
+		RemoveRoute( iter->first );
+	
+	_BlockTimer.Cancel();
 }
 
 void FileStorageClique::NoDownload()
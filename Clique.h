@@ -23,6 +23,9 @@
 // aka Group
 
 #include <vector>
+#include <tr1/unordered_map>
+
+#include <sys/time.h>
 
 #include "Thread.h"
 
@@ -30,8 +33,23 @@
 #include "Mutex.h"
 #include "Packet.h"
 #include "Socket.h"
+#include "Timer.h"
+
+#define DATA_XFER_BLOCK (256*1024) // bytes a download asks for per READ_REQ, capped by the peer's frame limit
+#define DATA_XFER_WINDOW 16 // READ_REQs a download keeps in flight
+#define DATA_XFER_TIMEOUT 10 // secs a READ_REQ gets to come back before its block goes to someone else
+
+#define ALPHA_CHUNK_SIZE (32*1024) // an ALPHA_CHUNK is cut once it gets this big
+#define ALPHA_STREAM_WINDOW (256*1024) // bytes of tree we let sit in a socket's send queue
+#define ALPHA_STREAM_LINGER 60 // secs a half sent tree is kept for its peer to reconnect and finish it
+#define ALPHA_CHUNK_LAST 1 // flag on the chunk that finishes the tree
+
+#define LIST_PAGE_SIZE (256*1024) // a paged LIST_RESP is cut once it gets this big
+#define LIST_PAGE_ENTRIES 16384 // or holds this many entries, the count has to fit a short
 
-#define DATA_XFER_BLOCK 4096
+#define LEASE_DURATION 300 // secs a client keeps metadata from an FS_RESP or LIST_RESP without asking again, unless we break it
+#define LEASE_SLACK 5 // we hold on to a lease a little longer than the client does, to cover the trip there
+#define LEASE_MAX 65536 // leases an alpha keeps track of, past that clients get the old LOCAL_CACHE_DURATION
 
 // CAUTION: None of Clique's non-static operations are thread safe! You MUST Lock() and Unlock() the Clique when using it.
 class Clique : public Mutex
@@ -41,6 +59,14 @@ public:
 	static bool HandleReceive( Socket *sock, PacketReader &reader );
 	static void ChangeAddr( const NetAddress &from, const NetAddress &to );
 	static void Disconnected( Socket *sock );
+	static void Drained( Socket *sock ); // sock's send queue just emptied
+	static void Identified( Socket *sock ); // sock's IN_PORT came in, so its address, protocol and frame limit are the real ones now
+	
+	// Packets are dispatched by request id first (responses we asked for), then by command for cliques that
+	// own a command outright, then by path to the clique of the file they name.
+	static void RegisterCommand( int cmd, Clique *c );
+	static void AddRoute( int reqID, int cmd, Clique *c );
+	static void RemoveRoute( int reqID );
 	
 	Clique();
 	virtual ~Clique();
@@ -61,7 +87,19 @@ public:
 	virtual void OnDisconnect( Socket *sock );
 
 protected:
+	struct Route
+	{
+		int cmd;
+		Clique *clique;
+	};
+	
+	typedef std::tr1::unordered_map<int, Route> RouteMap;
+	
+	static bool IsFileCommand( int cmd );
+	
 	static std::vector<Clique *> _Cliques;
+	static Clique *_Handlers[256];
+	static RouteMap _Routes;
 	static Mutex _GlobalMutex;
 	
 	AddressList _Members;
@@ -79,20 +117,52 @@ public:
 	virtual bool SendOnce( Packet &p );
 	virtual void AddMember( const NetAddress &addr ); 
 	
-	virtual void OnConnect( Socket *sock );
 	virtual bool OnReceive( Socket *sock, PacketReader &reader );
 	virtual void OnDisconnect( Socket *sock );
+	
+	void OnIdentified( Socket *sock ); // where a new peer gets the tree, OnConnect() is too early to know how to send it
+	void OnDrained( Socket *sock );
+	
+	// a lease is a promise to send a LEASE_BREAK before what we told a client about path changes. every alpha
+	// hears about every change, so each one only keeps track of the leases it handed out itself.
+	void Revoke( const char *path, bool tree = false ); // path, or its folder's listing, is about to change. tree if path is a folder going away or moving, taking everything under it along
 
 	virtual int ThreadMain();
 	
 private:
+	struct TreeStream
+	{
+		string cursor; // path of the last entry we sent, empty before the first chunk
+		bool busy; // somebody is pumping it right now
+		time_t gone; // when they dropped off, 0 while they're connected
+	};
+	
+	typedef std::map<NetAddress, TreeStream> StreamMap;
+	
+	typedef std::map<NetAddress, time_t> LeaseHolders; // who -> when their lease runs out
+	typedef std::tr1::unordered_map<string, LeaseHolders> LeaseMap; // normalized path -> holders
+	
+	void SendTree( Socket *sock ); // hands sock the namespace, in whatever format it speaks
+	void PumpTree( Socket *sock ); // sends the next few chunks of sock's stream
+	void BecomeAlpha( Socket *from );
+	
+	int Grant( Socket *sock, const char *path ); // secs sock may cache path for, 0 for no lease
+	void Revoke( const string &key, const char *path, bool tree ); // breaks the leases on key, and with tree every one under it, telling the holders path
+	
 	bool _Initing, _IsAlpha;
 	Socket *_Local;
+	
+	StreamMap _Streams; // trees we are still sending, by who they're going to. kept across reconnects so we can pick up where we left off
+	
+	LeaseMap _Leases;
+	int _LeaseCount;
 };
 
 class FileStorageClique : public Clique
 {
 public:
+	static void Window( int blocks ) { _Window = blocks > 0 ? blocks : 1; }
+	
 	FileStorageClique( File *file );
 	~FileStorageClique();
 	
@@ -100,16 +170,74 @@ public:
 	
 	void JoinClique( bool sync = false );
 	
+	// sends OPEN_REQ to every connected member at once and goes with the first one that has the file.
+	// returns its version and who it was, or -errno if nobody could help
+	int OpenRemote( int flags, NetAddress &source );
+	
 	int DataRequestID() const { return _DataID; }
 	
 	virtual bool OnReceive( Socket *sock, PacketReader &reader );
+	virtual void OnDisconnect( Socket *sock );
 	
-	void DownloadFrom( Socket *sock, int ver );
+	void DownloadFrom( Socket *sock, int ver ); // also swarms from every other connected member known to hold all of ver
+	void AddSource( Socket *sock ); // another peer to pull blocks of the current download from
+	void Holder( const NetAddress &addr, int ver ); // addr told us it has a whole copy of ver
 	void NoDownload();
 	
 private:
+	struct Source
+	{
+		int inFlight;
+		double bytes;
+		timeval start;
+	};
+	
+	struct Block; // in Clique.cpp, NetAddress isn't complete yet when Buddy.h pulls us in
+	
+	class BlockTimer : public Timer
+	{
+	public:
+		explicit BlockTimer( FileStorageClique *clique ) : _Clique( clique ) {}
+		
+	protected:
+		virtual void OnTimer() { _Clique->ExpireBlocks(); }
+		
+	private:
+		FileStorageClique *_Clique;
+	};
+	
+	typedef std::map<int, Block> BlockMap; // READ_REQ id -> Block
+	typedef std::map<NetAddress, Source> SourceMap;
+	typedef std::map<NetAddress, int> HolderMap; // who -> version they have all of
+	
+	void RequestBlocks();
+	void CancelBlocks();
+	void DropSource( const NetAddress &addr, vector<int> &routes ); // must be locked
+	void ExpireBlocks(); // blocks past their deadline go back to _Retry and whoever sat on them is dropped
+	void Arm(); // points _BlockTimer at the next deadline
+	void FallBack( const NetAddress &except ); // no sources left, find more
+	
+	bool AddHolders( const NetAddress &except ); // every connected holder of the version we're after becomes a source, false if none did
+	void FindSources(); // asks every connected member again, the ones that have it turn up through Holder()
+	void Ask( unsigned int reqID ); // answers to reqID's OPEN_REQ go to OnLateOpen()
+	
+	static void OnLateOpen( PacketReader &resp, void *arg );
+	static double Rate( const Source &src, const timeval &now );
+	
+	static int _Window;
+	
 	File *_File;
 	int _DataID;
+	int _BlockSize; // multiple of BUFF_BLOCK_SIZE so every DATA_BLOCK lands on whole bitmap blocks
+	
+	BlockMap _InFlight;
+	SourceMap _Sources;
+	std::list<off_t> _Retry; // blocks that have to be asked for again
+	BlockTimer _BlockTimer;
+	
+	HolderMap _Holders; // members that answered an OPEN_REQ with a whole copy, members still downloading aren't in here
+	vector<unsigned int> _Asking; // OPEN_REQs whose answers nobody is waiting on, they just feed _Holders
+	off_t _NextBlock; // first block nobody has been asked for yet
 };
 
 #endif
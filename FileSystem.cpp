@@ -26,58 +26,137 @@ using namespace std;
 
 #include "Buddy.h"
 #include "FileSystem.h"
+#include "Stats.h"
+#include "Log.h"
 #include "drm.h"
 
+ExpiryQueue FileSystem::_Expiry; // before _Root, its ctor wants the queue there
+Mutex FileSystem::_ExpiryMutex;
 Folder *FileSystem::_Root = new Folder( "/", NULL );
 int FileSystem::_LastSave = 0;
+PathCache FileSystem::_Paths;
+Mutex FileSystem::_PathMutex;
+MissCache FileSystem::_Misses;
+int FileSystem::_MissCount = 0;
+Mutex FileSystem::_MissMutex;
 
 void FileSystem::Slice()
 {
 	if ( _LastSave + 30 < time(NULL) )
 		SaveLocal();
 	
+	Stats::Slice();
+	
 	if ( !Alpha.ThisIsAlpha() )
-	{
-		_Root->_Expire = 1;
+		ExpireDue();
+	else
+		ClearExpiry(); // the alpha's copy is the real one, nothing in it expires
+}
+
+void FileSystem::Schedule( FSObject *obj, int when )
+{
+	if ( obj->Parent() == NULL )
+		return; // the root never goes
 	
-		RecurseExpire( _Root );
-	}
+	_ExpiryMutex.Lock();
+	
+	if ( obj->_Queued )
+		_Expiry.erase( obj->_Due );
+	
+	obj->_Due = _Expiry.insert( ExpiryQueue::value_type( when, obj ) );
+	obj->_Queued = true;
+	
+	_ExpiryMutex.Unlock();
 }
 
-bool FileSystem::RecurseExpire( FSObject *obj )
+void FileSystem::Unschedule( FSObject *obj )
 {
-	bool expired = !obj->IsLocal() && obj->CacheExpireTime() > 0 && obj->CacheExpireTime() < time(NULL);
+	_ExpiryMutex.Lock();
 	
-	if ( expired && obj->IsFolder() )
+	if ( obj->_Queued )
 	{
-		expired = true;
-		FSList list = ((Folder*)obj)->GetList();
-		for(FSList::iterator iter=list.begin(); iter != list.end(); iter++)
-			expired &= RecurseExpire( *iter );
+		_Expiry.erase( obj->_Due );
+		obj->_Queued = false;
 	}
 	
-	if ( expired )
+	_ExpiryMutex.Unlock();
+}
+
+void FileSystem::ClearExpiry()
+{
+	_ExpiryMutex.Lock();
+	
+	for ( ExpiryQueue::iterator iter = _Expiry.begin(); iter != _Expiry.end(); iter++ )
+		iter->second->_Queued = false;
+	
+	_Expiry.clear();
+	
+	_ExpiryMutex.Unlock();
+}
+
+void FileSystem::Emptied( Folder *fld )
+{
+	// Reap() skipped it while it still had something in it, nothing else would queue it again
+	if ( fld != _Root && fld->Count() == 0 && !fld->IsLocal() && fld->_Expire > 0 && fld->_Expire < time(NULL) )
+		Schedule( fld, fld->_Expire );
+}
+
+void FileSystem::ExpireDue()
+{
+	time_t now = time(NULL);
+	
+	for (;;)
 	{
-		FSObject *p = obj->Parent();
+		_ExpiryMutex.Lock();
 		
-		if ( p != NULL && p->IsFolder() )
+		ExpiryQueue::iterator iter = _Expiry.begin();
+		if ( iter == _Expiry.end() || iter->first >= now )
 		{
-			FSList &list = ((Folder*)p)->GetList();
-			for(FSList::iterator iter=list.begin(); iter != list.end(); iter++)
-			{
-				if ( *iter == obj )
-				{
-					list.erase( iter );
-					break;
-				}
-			}
+			_ExpiryMutex.Unlock();
+			break;
 		}
 		
-		if ( obj != _Root )
-			delete obj;
+		FSObject *obj = iter->second;
+		_Expiry.erase( iter );
+		obj->_Queued = false;
+		
+		_ExpiryMutex.Unlock();
+		
+		Reap( obj, now );
+	}
+}
+
+void FileSystem::Reap( FSObject *obj, time_t now )
+{
+	while ( obj != NULL && obj != _Root )
+	{
+		if ( obj->IsLocal() || obj->CacheExpireTime() <= 0 || obj->CacheExpireTime() >= now )
+			return; // cached again since it was queued, it's queued again too
+		
+		// a folder goes once the last thing in it has, which brings us back here
+		if ( obj->IsFolder() && ((Folder*)obj)->Count() > 0 )
+			return;
+		
+		// leased files expire now, but not out from under someone using them
+		if ( obj->IsFile() && ((File*)obj)->IsOpen() )
+		{
+			Schedule( obj, now + 1 );
+			return;
+		}
+		
+		FSObject *p = obj->Parent();
+		
+		Uncache( obj );
+		
+		((Folder*)p)->Remove( obj );
+		
+		if ( obj->IsFile() )
+			((File*)obj)->Lock(); // the dtor expects it locked
+		
+		delete obj;
+		
+		obj = p;
 	}
-	
-	return expired;
 }
 
 
@@ -155,7 +234,7 @@ void FileSystem::LoadLocal()
 					if ( file->_Capacity <= 0 )
 						file->_Capacity = BUFF_BLOCK_SIZE;
 					
-					file->_Data = new char[file->_Capacity];
+					file->AllocData( file->_Capacity );
 					
 					DRMManager->ReadDRM( file, reader );
 					
@@ -189,8 +268,8 @@ void FileSystem::SaveLocal()
 	{
 		if ( !errored )
 		{
-			cerr << "PANIC! Unable to save local data! Everything is going black! Aaarrrgggghhhh!!" << endl;
-			cerr << "...Move towards the light, Buddy...." << endl;
+			LOG( LOG_ERROR, "PANIC! Unable to save local data! Everything is going black! Aaarrrgggghhhh!!" );
+			LOG( LOG_ERROR, "...Move towards the light, Buddy...." );
 			errored = true;
 		}
 		return;
@@ -207,11 +286,13 @@ void FileSystem::RecurseSave( FSObject *obj, ofstream &data )
 {
 	if ( strcmp( obj->Name(), "/" ) )
 	{
-		Packet p( 0, 0, 128 ); // default buffer capacity
+		string path = obj->FullPath();
+		
+		Packet p( 0, 0, Packet::PAYLOAD_BEGIN + 1 + path.size()+1 + 4*3 + 1 );
 		
 		p.WriteByte( obj->Type() );
 		
-		p.WriteASCII( obj->FullPath().c_str() );
+		p.WriteASCII( path.c_str() );
 		
 		// write generic FSObject stuff here
 		//Mode (Unsigned Integer)
@@ -278,31 +359,26 @@ void FileSystem::RemoveObject( FSObject *obj )
 	if ( obj == NULL || obj == _Root || obj->Parent() == NULL )
 		return;
 	
-	FSList *list;
-	
 	if ( obj->IsFolder() )
 	{
-		list = &((Folder*)obj)->GetList();
+		Folder *fld = (Folder*)obj;
 		
-		while ( list->size() > 0 )
-			FileSystem::RemoveObject( *list->begin() );
+		while ( fld->Count() > 0 )
+			FileSystem::RemoveObject( fld->GetList().front() );
 	}
 	else
 	{
 		((File*)obj)->Lock(); // need to lock the file to remove it
 	}
 	
-	list = &((Folder*)obj->Parent())->GetList();
-	for(FSList::iterator iter = list->begin(); iter != list->end(); iter++)
-	{
-		if ( *iter == obj )
-		{
-			list->erase( iter );
-			break;
-		}
-	}
+	Uncache( obj );
+	
+	Folder *parent = (Folder*)obj->Parent();
+	parent->Remove( obj );
 	
 	delete obj; // it is EXPECTED if its a file it is locked before delete is called. Unlock called by the dtor
+	
+	Emptied( parent );
 }
 
 FSObject *FileSystem::AddObject( const char *path, int type, bool brokenPaths )
@@ -327,23 +403,20 @@ FSObject *FileSystem::AddObject( const char *path, int type, bool brokenPaths )
 		last = cur;
 		cur = NULL;
 		
-		FSList &list = last->GetList();
+		FSObject *child = last->Find( temp );
 		
-		for( FSList::iterator iter = list.begin(); iter != list.end() && cur == NULL; iter++ )
+		if ( child )
 		{
-			if ( !strcmp( (*iter)->Name(), temp ) )
-			{
-				if ( (*iter)->IsFolder() )
-					cur = (Folder*)*iter;
-				else
-					return NULL;
-			}
+			if ( child->IsFolder() )
+				cur = (Folder*)child;
+			else
+				return NULL;
 		}
 		
 		if ( brokenPaths && *ptr && !cur )
 		{
 			Folder *brokenPath = new Folder( temp, last );
-			last->GetList().push_back( brokenPath );
+			last->Add( brokenPath );
 			cur = brokenPath;
 		}
 	}
@@ -357,17 +430,261 @@ FSObject *FileSystem::AddObject( const char *path, int type, bool brokenPaths )
 	else
 		newObj = new File( temp, last );
 	
-	last->GetList().push_back( newObj );
+	last->Add( newObj );
+	Appeared( path );
+	
 	return newObj;
 }
 
-FSObject *FileSystem::GetObject( const char *path )
+int FileSystem::Normalize( const char *path, char *out )
 {
-	//Is the FSObj in the Cache?
-	char temp[MAX_PATH];
-	const char *ptr = path;
+	int len = 0;
+	
+	while ( *path && len < MAX_PATH - 2 )
+	{
+		while ( *path == '/' )
+			path++;
+		
+		if ( !*path )
+			break;
+		
+		out[len++] = '/';
+		
+		while ( *path && *path != '/' && len < MAX_PATH - 1 )
+			out[len++] = *path++;
+	}
+	
+	if ( len == 0 )
+		out[len++] = '/';
+	
+	out[len] = 0;
+	
+	return len;
+}
+
+unsigned long long FileSystem::PathHash( const char *path, int len )
+{
+	unsigned long long h = 14695981039346656037ull; // 64 bit FNV-1a
+	
+	for ( int i = 0; i < len; i++ )
+		h = ( h ^ (unsigned char)path[i] ) * 1099511628211ull;
+	
+	return h;
+}
+
+void FileSystem::Uncache( FSObject *obj )
+{
+	_PathMutex.Lock();
+	
+	// a folder takes everything under it along, and those paths aren't cheap to find, so start over
+	if ( obj->IsFolder() && ((Folder*)obj)->Count() > 0 )
+	{
+		_Paths.clear();
+	}
+	else
+	{
+		string path = obj->FullPath();
+		PathCache::iterator iter = _Paths.find( PathHash( path.data(), path.size() ) );
+		
+		if ( iter != _Paths.end() && iter->second.obj == obj )
+			_Paths.erase( iter );
+	}
+	
+	_PathMutex.Unlock();
+}
+
+bool FileSystem::SplitMissing( const char *path, string &folder, string &name )
+{
+	char key[MAX_PATH];
+	int len = Normalize( path, key );
+	
+	if ( len <= 1 )
+		return false; // the root is never missing
+	
+	char *slash = strrchr( key, '/' );
+	
+	name = slash + 1;
+	folder.assign( key, slash == key ? 1 : slash - key );
+	
+	return true;
+}
+
+bool FileSystem::KnownMissing( const char *path )
+{
+	string folder, name;
+	bool missing = false;
+	
+	if ( !SplitMissing( path, folder, name ) )
+		return false;
+	
+	_MissMutex.Lock();
+	
+	MissCache::iterator iter = _Misses.find( folder );
+	if ( iter != _Misses.end() )
+	{
+		MissNames::iterator entry = iter->second.find( name );
+		
+		if ( entry != iter->second.end() )
+		{
+			if ( entry->second > time(NULL) )
+			{
+				missing = true;
+			}
+			else
+			{
+				iter->second.erase( entry );
+				_MissCount--;
+				
+				if ( iter->second.empty() )
+					_Misses.erase( iter );
+			}
+		}
+	}
+	
+	_MissMutex.Unlock();
+	
+	return missing;
+}
+
+void FileSystem::Missing( const char *path )
+{
+	string folder, name;
+	
+	if ( !SplitMissing( path, folder, name ) )
+		return;
+	
+	_MissMutex.Lock();
+	
+	// expired entries only go when they're looked at, so this is also what keeps stale ones from piling up
+	if ( _MissCount >= MISS_CACHE_MAX )
+	{
+		_Misses.clear();
+		_MissCount = 0;
+	}
+	
+	MissNames &names = _Misses[folder];
+	
+	if ( names.find( name ) == names.end() )
+		_MissCount++;
+	
+	names[name] = time(NULL) + MISS_CACHE_DURATION;
+	
+	_MissMutex.Unlock();
+}
+
+void FileSystem::Appeared( const char *path )
+{
+	string folder, name;
+	
+	_MissMutex.Lock();
+	
+	if ( path == NULL )
+	{
+		_Misses.clear();
+		_MissCount = 0;
+	}
+	else if ( SplitMissing( path, folder, name ) )
+	{
+		ForgetMissing( folder );
+	}
+	
+	_MissMutex.Unlock();
+}
+
+void FileSystem::ForgetMissing( const string &folder )
+{
+	// must hold _MissMutex
+	MissCache::iterator iter = _Misses.find( folder );
+	
+	if ( iter != _Misses.end() )
+	{
+		_MissCount -= iter->second.size();
+		_Misses.erase( iter );
+	}
+}
+
+void FileSystem::BreakLease( const char *path, bool tree )
+{
+	char key[MAX_PATH];
+	Normalize( path, key );
+	
+	// path may be a folder whose listing changed, so whatever we thought was missing from it goes too
+	Appeared( key );
+	
+	_MissMutex.Lock();
+	ForgetMissing( key );
+	_MissMutex.Unlock();
+	
+	// not removed here, whoever looked it up last may still be using it. it's refreshed in place the next time it's asked for
+	FSObject *obj = FindObject( key );
+	
+	if ( obj && obj != _Root && !obj->IsLocal() )
+		BreakObject( obj );
+	
+	// the folder moved or went away. whatever was under it is wrong too, and the paths we remember to it lead
+	// somewhere that isn't there anymore
+	if ( tree && obj && obj->IsFolder() )
+	{
+		Uncache( obj );
+		
+		const FSList &list = ((Folder*)obj)->GetList();
+		
+		for ( FSListIter iter = list.begin(); iter != list.end(); iter++ )
+			RecurseDrop( *iter );
+	}
+}
+
+void FileSystem::BreakObject( FSObject *obj )
+{
+	obj->_Expire = LEASE_BROKEN;
+	
+	Schedule( obj, LEASE_BROKEN ); // if nobody asks for it before the next Slice(), it goes
+}
+
+void FileSystem::DropLeases()
+{
+	const FSList &list = _Root->GetList();
+	
+	for ( FSListIter iter = list.begin(); iter != list.end(); iter++ )
+		RecurseDrop( *iter );
+}
+
+void FileSystem::RecurseDrop( FSObject *obj )
+{
+	if ( !obj->IsLocal() && obj->_Expire != 0 )
+		BreakObject( obj );
+	
+	if ( obj->IsFolder() )
+	{
+		const FSList &list = ((Folder*)obj)->GetList();
+		
+		for ( FSListIter iter = list.begin(); iter != list.end(); iter++ )
+			RecurseDrop( *iter );
+	}
+}
+
+FSObject *FileSystem::FindObject( const char *path )
+{
+	char temp[MAX_PATH], key[MAX_PATH];
+	int len = Normalize( path, key );
+	unsigned long long hash = PathHash( key, len );
+	const char *ptr = key;
 	FSObject *cur = _Root;
 	
+	if ( len > 1 )
+	{
+		FSObject *hit = NULL;
+		
+		_PathMutex.Lock();
+		PathCache::iterator iter = _Paths.find( hash );
+		if ( iter != _Paths.end() && iter->second.path == key )
+			hit = iter->second.obj;
+		_PathMutex.Unlock();
+		
+		if ( hit )
+			return hit;
+	}
+	
 	while ( *ptr == '/' )
 		ptr++;
 	
@@ -388,38 +705,85 @@ FSObject *FileSystem::GetObject( const char *path )
 		while ( *ptr == '/' ) // skip extra /s
 			ptr++;
 		
-		FSList &list = ((Folder*)cur)->GetList();
+		cur = ((Folder*)cur)->Find( temp );
+	}
+	
+	if ( cur && cur != _Root )
+	{
+		_PathMutex.Lock();
 		
-		cur = NULL;
-		for( FSList::iterator iter = list.begin(); iter != list.end() && cur == NULL; iter++ )
-		{
-			if ( !strcmp( (*iter)->Name(), temp ) )
-				cur = *iter;
-		}
+		if ( _Paths.size() >= PATH_CACHE_MAX )
+			_Paths.clear();
+		
+		PathEntry &e = _Paths[hash];
+		e.path.assign( key, len );
+		e.obj = cur;
+		
+		_PathMutex.Unlock();
 	}
 	
+	return cur;
+}
+
+FSObject *FileSystem::GetObject( const char *path )
+{
+	//Is the FSObj in the Cache?
+	char temp[MAX_PATH];
+	FSObject *cur = FindObject( path );
+	
+	// the alpha broke our lease on it, or it ran out and just hasn't been reaped yet (a folder isn't while it
+	// has anything in it). either way what we have can't be trusted until we've asked again
+	if ( cur != NULL && cur != _Root && !cur->IsLocal() && cur->_Expire > 0 && cur->_Expire < time(NULL) && !Alpha.ThisIsAlpha() )
+		cur = NULL;
+	
 	//If the FSObj is not in the cache (or I need to request a full file record) and I am not the AlphaClique
 	if ( cur == NULL && !Alpha.ThisIsAlpha() )
 	{
+		if ( KnownMissing( path ) )
+		{
+			errno = ENOENT;
+			return NULL;
+		}
+		
 		Packet req( FS_REQ );
 		req.WriteASCII( path );
+		req.WriteByte( PROTOCOL_VERSION ); // an alpha that knows v2 answers in it
 		
 		NetworkRequest::Register( FS_RESP, req.RequestID() );
 			
 		if ( !Alpha.SendOnce( req ) )
 			return NULL;
 		
-		if ( !NetworkRequest::WaitForResponse( req.RequestID() ) )
-			return NULL;
-		
-		PacketReader reader = NetworkRequest::GetResponse( req.RequestID() );
+		PacketReader reader = NetworkRequest::WaitForResponse( req.RequestID() );
 		
 		if ( !reader.IsValid() || reader.Command() != FS_RESP )
 			return NULL;
 		
 		//AlphaClique has file info	
 		int val = reader.ReadShort();
-		if ( val == 1 )
+		if ( val == PACKET_V2_MARK )
+		{
+			FSEntry e;
+			EntryReader entries( reader );
+			
+			val = reader.ReadShort();
+			if ( val == 1 && entries.Read( e ) )
+			{
+				cur = ApplyEntry( e );
+				
+				if ( cur )
+					Lease( cur, reader.AtEnd() ? 0 : reader.ReadUnsignedInt() ); // only alphas that speak 4 send one
+				
+				return cur;
+			}
+			
+			if ( val == -ENOENT )
+				Missing( path );
+			
+			errno = abs(val);
+			return NULL;
+		}
+		else if ( val == 1 )
 		{ 
 			reader.ReadASCII( temp, MAX_PATH );
 			char type = reader.ReadByte();
@@ -427,7 +791,7 @@ FSObject *FileSystem::GetObject( const char *path )
 			cur = AddObject( temp, type );
 			
 			if ( !cur )
-				cur = GetObject( temp );
+				cur = FindObject( temp ); // already here, just out of date. GetObject() would ask about it all over again
 			
 			if ( !cur )
 				return NULL;
@@ -444,14 +808,20 @@ FSObject *FileSystem::GetObject( const char *path )
 				
 				fcur->Size( (size_t)reader.ReadUnsignedInt() );
 				
-				int count = reader.ReadInt();
+				AddressList list;
+				reader.ReadAddresses( list, reader.ReadInt() );
 				
-				for(int i=0;i<count;i++)
-					fcur->GetClique()->AddMember( reader.ReadAddress() );
+				for ( AddressList::iterator iter = list.begin(); iter != list.end(); iter++ )
+					fcur->GetClique()->AddMember( *iter );
 			}
+			
+			Lease( cur, 0 ); // a v1 alpha never leases, but what we have is good again for a while
 		}
 		else 
 		{
+			if ( val == -ENOENT )
+				Missing( path );
+			
 			errno = abs(val);
 			return NULL;
 		}
@@ -460,42 +830,203 @@ FSObject *FileSystem::GetObject( const char *path )
 	return cur;
 }
 
-void FileSystem::BuildList( list<string> &lst, FSObject *obj, string currentPath )
+Folder *FileSystem::ListFolder( const char *path )
 {
-	if ( obj == NULL )
-		return;
-	
-	if ( obj != _Root )
-		currentPath += "/" + string( obj->Name() );
+	char key[MAX_PATH];
+	int len = Normalize( path, key );
 	
-	if ( obj->IsFile() )
+	if ( Alpha.ThisIsAlpha() )
 	{
-		if ( ((File*)obj)->IsLocal() )
-			lst.push_back( currentPath );
-		return;
+		FSObject *obj = FindObject( key );
+		
+		if ( obj == NULL || !obj->IsFolder() )
+		{
+			errno = obj ? ENOTDIR : ENOENT;
+			return NULL;
+		}
+		
+		return (Folder*)obj;
 	}
 	
-	Folder *fld = (Folder*)obj;
-	
-	for(FSListIter iter = fld->GetList().begin(); iter != fld->GetList().end(); iter++)
-		BuildList( lst, *iter, currentPath );
-}
-
-void FileSystem::WriteFullList( Packet &p, FSObject *obj, string currentPath )
-{
-	if ( obj == NULL )
-		return;
+	string prefix( key, len == 1 ? 0 : len ), after;
+	std::tr1::unordered_set<string> seen;
+	Folder *folder = NULL;
+	int lease = 0;
 	
-	if ( obj != _Root )
+	do
 	{
-		currentPath += "/";
-		currentPath += obj->Name();
-	
-		p.WriteASCII( currentPath.c_str() );
-		p.WriteByte( obj->Type() );
-		p.WriteUnsignedInt( obj->Mode() );
-		p.WriteUnsignedInt( obj->mTime() );
-		p.WriteUnsignedInt( obj->cTime() );
+		Packet req( LIST_REQ );
+		req.WriteASCII( key );
+		req.WriteByte( PROTOCOL_VERSION );
+		req.WriteASCII( after.c_str() );
+		
+		NetworkRequest::Register( LIST_RESP, req.RequestID() );
+		
+		if ( !Alpha.SendOnce( req ) )
+		{
+			errno = EIO;
+			return NULL;
+		}
+		
+		PacketReader reader = NetworkRequest::WaitForResponse( req.RequestID() );
+		
+		if ( !reader.IsValid() || reader.Command() != LIST_RESP )
+		{
+			errno = EIO;
+			return NULL;
+		}
+		
+		// an alpha from before v2 answers with the count right away, and like any alpha from before 5 it sends
+		// the whole folder in one go and no cookie
+		int val = reader.ReadShort();
+		bool v1 = val != PACKET_V2_MARK;
+		
+		if ( v1 && val < 0 )
+		{
+			if ( val == -ENOENT )
+				Missing( key );
+			
+			errno = -val;
+			return NULL;
+		}
+		
+		if ( folder == NULL )
+		{
+			FSObject *obj = FindObject( key );
+			
+			if ( obj == NULL )
+				obj = AddObject( key, DT_DIR, true );
+			
+			if ( obj == NULL || !obj->IsFolder() )
+			{
+				errno = ENOTDIR;
+				return NULL;
+			}
+			
+			folder = (Folder*)obj;
+		}
+		
+		int count = v1 ? val : (unsigned short)reader.ReadShort();
+		vector<FSObject *> page;
+		FSEntry e;
+		EntryReader entries( reader );
+		
+		page.reserve( count );
+		
+		for ( int i = 0; i < count && ( v1 ? EntryReader::ReadV1( reader, e ) : entries.Read( e ) ); i++ )
+		{
+			seen.insert( e.path );
+			
+			e.path = prefix + "/" + e.path; // a LIST_RESP only has names
+			
+			FSObject *obj = ApplyEntry( e );
+			
+			if ( obj )
+				page.push_back( obj );
+		}
+		
+		lease = v1 || reader.AtEnd() ? 0 : reader.ReadUnsignedInt();
+		
+		for ( unsigned int i = 0; i < page.size(); i++ )
+			Lease( page[i], lease );
+		
+		char cookie[MAX_PATH] = ""; // an alpha that doesn't page sends everything at once and no cookie
+		
+		if ( !reader.AtEnd() )
+			reader.ReadASCII( cookie, MAX_PATH );
+		
+		after = cookie;
+	}
+	while ( !after.empty() );
+	
+	Lease( folder, lease );
+	
+	// that was all of it, so anything else we have in there is gone
+	const FSList &list = folder->GetList();
+	vector<FSObject *> gone;
+	
+	for ( FSListIter iter = list.begin(); iter != list.end(); iter++ )
+	{
+		if ( !(*iter)->IsLocal() && seen.find( (*iter)->Name() ) == seen.end() )
+			gone.push_back( *iter );
+	}
+	
+	for ( unsigned int i = 0; i < gone.size(); i++ )
+	{
+		// not out from under someone using it, or with our replicas in it. broken, it goes once what's
+		// holding it does
+		if ( InUse( gone[i] ) )
+			RecurseDrop( gone[i] );
+		else
+			RemoveObject( gone[i] );
+	}
+	
+	return folder;
+}
+
+bool FileSystem::InUse( FSObject *obj )
+{
+	if ( obj->IsFile() )
+		return obj->IsLocal() || ((File*)obj)->IsOpen();
+	
+	const FSList &list = ((Folder*)obj)->GetList();
+	
+	for ( FSListIter iter = list.begin(); iter != list.end(); iter++ )
+	{
+		if ( InUse( *iter ) )
+			return true;
+	}
+	
+	return false;
+}
+
+void FileSystem::Lease( FSObject *obj, int secs )
+{
+	if ( secs > 0 )
+		CacheObject( obj, secs );
+	else if ( obj->_Expire != 0 && obj->_Expire < time(NULL) )
+		CacheObject( obj, LOCAL_CACHE_DURATION ); // broken or run out, we just heard about it even without a lease
+}
+
+void FileSystem::BuildList( list<string> &lst, FSObject *obj, string currentPath )
+{
+	if ( obj == NULL )
+		return;
+	
+	if ( obj != _Root )
+		currentPath += "/" + string( obj->Name() );
+	
+	if ( obj->IsFile() )
+	{
+		if ( ((File*)obj)->IsLocal() )
+			lst.push_back( currentPath );
+		return;
+	}
+	
+	Folder *fld = (Folder*)obj;
+	
+	for(FSListIter iter = fld->GetList().begin(); iter != fld->GetList().end(); iter++)
+		BuildList( lst, *iter, currentPath );
+}
+
+void FileSystem::WriteFullList( Packet &p, FSObject *obj, string currentPath )
+{
+	if ( obj == NULL )
+		return;
+	
+	if ( obj == _Root )
+		p.EnsureCapacity( p.Length() + ListSize( obj ) ); // one allocation for the whole tree
+	
+	if ( obj != _Root )
+	{
+		currentPath += "/";
+		currentPath += obj->Name();
+	
+		p.WriteASCII( currentPath.c_str() );
+		p.WriteByte( obj->Type() );
+		p.WriteUnsignedInt( obj->Mode() );
+		p.WriteUnsignedInt( obj->mTime() );
+		p.WriteUnsignedInt( obj->cTime() );
 	}
 	if ( obj->IsFile() )
 	{
@@ -506,9 +1037,7 @@ void FileSystem::WriteFullList( Packet &p, FSObject *obj, string currentPath )
 		AddressList list = file->GetClique()->Members();
 						
 		p.WriteInt( list.size() );
-						
-		for(AddressList::const_iterator iter = list.begin(); iter != list.end(); iter++)
-			p.WriteAddress( *iter );
+		p.WriteAddresses( list );
 	}
 	else
 	{
@@ -518,9 +1047,88 @@ void FileSystem::WriteFullList( Packet &p, FSObject *obj, string currentPath )
 	}
 }
 
+void FileSystem::WriteFullList( EntryWriter &w, FSObject *obj, string currentPath )
+{
+	if ( obj == NULL )
+		return;
+	
+	if ( obj != _Root )
+	{
+		currentPath += "/";
+		currentPath += obj->Name();
+		
+		w.Write( obj, currentPath );
+	}
+	
+	if ( obj->IsFolder() )
+	{
+		Folder *fld = (Folder*)obj;
+		for(FSListIter iter = fld->GetList().begin(); iter != fld->GetList().end(); iter++)
+			WriteFullList( w, *iter, currentPath );
+	}
+}
+
+FSObject *FileSystem::ApplyEntry( const FSEntry &e )
+{
+	FSObject *obj = AddObject( e.path.c_str(), e.type );
+	if ( !obj )
+		obj = FindObject( e.path.c_str() );
+	
+	if ( !obj )
+		return NULL;
+	
+	obj->Mode( e.mode );
+	obj->mTime( e.mtime );
+	obj->cTime( e.ctime );
+	
+	if ( obj->IsFile() )
+	{
+		File *file = (File*)obj;
+		
+		file->Size( e.size );
+		
+		for ( AddressList::const_iterator iter = e.members.begin(); iter != e.members.end(); iter++ )
+			file->GetClique()->AddMember( *iter );
+	}
+	
+	return obj;
+}
+
+int FileSystem::EntrySize( FSObject *obj, int nameLen )
+{
+	int size = nameLen + 1 + 1 + 4*3;
+	
+	if ( obj->IsFile() )
+		size += 4 + 4 + 6*((File*)obj)->GetClique()->NumberOfMembers();
+	
+	return size;
+}
+
+int FileSystem::ListSize( FSObject *obj, int pathLen )
+{
+	int size = 0;
+	
+	if ( obj != _Root )
+	{
+		pathLen += 1 + strlen( obj->Name() );
+		size += EntrySize( obj, pathLen );
+	}
+	
+	if ( obj->IsFolder() )
+	{
+		Folder *fld = (Folder*)obj;
+		for(FSListIter iter = fld->GetList().begin(); iter != fld->GetList().end(); iter++)
+			size += ListSize( *iter, pathLen );
+	}
+	
+	return size;
+}
+
 void FileSystem::CacheObject( FSObject *obj, int exipre )
 {
 	obj->_Expire = time(NULL) + exipre;
+	
+	Schedule( obj, obj->_Expire );
 }
 
 
@@ -530,15 +1138,11 @@ void FSObject::Move( const char *to )
 	if ( _Parent == NULL )
 		return;
 	
-	FSList *list = &((Folder*)_Parent)->GetList();
-	for ( FSList::iterator iter = list->begin(); iter != list->end(); iter++ )
-	{
-		if ( *iter == this )
-		{
-			list->erase( iter );
-			break;
-		}
-	}
+	FileSystem::Uncache( this );
+	
+	Folder *from = (Folder*)_Parent;
+	from->Remove( this );
+	FileSystem::Emptied( from );
 	
 	// the following was copied almost exactly from AddObject
 	char temp[MAX_PATH];
@@ -561,23 +1165,20 @@ void FSObject::Move( const char *to )
 		last = cur;
 		cur = NULL;
 		
-		FSList &list = last->GetList();
+		FSObject *child = last->Find( temp );
 		
-		for( FSList::iterator iter = list.begin(); iter != list.end() && cur == NULL; iter++ )
+		if ( child )
 		{
-			if ( !strcmp( (*iter)->Name(), temp ) )
-			{
-				if ( (*iter)->IsFolder() )
-					cur = (Folder*)*iter;
-				else
-					return;
-			}
+			if ( child->IsFolder() )
+				cur = (Folder*)child;
+			else
+				return;
 		}
 		
 		if ( *ptr && !cur )
 		{
 			Folder *brokenPath = new Folder( temp, last );
-			last->GetList().push_back( brokenPath );
+			last->Add( brokenPath );
 			cur = brokenPath;
 		}
 	}
@@ -588,7 +1189,9 @@ void FSObject::Move( const char *to )
 		return; // tried to add a folder that already exists
 	
 	_Parent = last;
-	last->GetList().push_back( this );
+	last->Add( this );
+	
+	FileSystem::Appeared( to );
 }
 
 string FSObject::FullPath() const
@@ -607,8 +1210,45 @@ string FSObject::FullPath() const
 
 
 
+FSObject *Folder::Find( const char *name ) const
+{
+	FSIndex::const_iterator iter = _Index.find( name );
+	
+	return iter != _Index.end() ? *iter->second : NULL;
+}
+
+FSListIter Folder::Locate( const char *name ) const
+{
+	FSIndex::const_iterator iter = _Index.find( name );
+	
+	return iter != _Index.end() ? FSListIter( iter->second ) : _List.end();
+}
+
+bool Folder::Add( FSObject *obj )
+{
+	if ( _Index.find( obj->Name() ) != _Index.end() )
+		return false;
+	
+	_Index.insert( FSIndex::value_type( obj->Name(), _List.insert( _List.end(), obj ) ) );
+	
+	return true;
+}
+
+void Folder::Remove( FSObject *obj )
+{
+	FSIndex::iterator iter = _Index.find( obj->Name() );
+	
+	if ( iter != _Index.end() && *iter->second == obj )
+	{
+		_List.erase( iter->second );
+		_Index.erase( iter );
+	}
+}
+
+
+
 File::File( const char *name, FSObject *parent ) : FSObject( name, DT_REG, parent ), 
-	_Clique( new FileStorageClique( this ) ), _Size( 0 ), _Capacity( 0 ), _Recvd( 0 ), _LocalSize( 0 ), _Data( NULL ),
+	_Clique( new FileStorageClique( this ) ), _Size( 0 ), _Capacity( 0 ), _Recvd( 0 ), _LocalSize( 0 ), _Data( NULL ), _DataBuf( NULL ),
 	_WriteBuff( NULL ), _WBCap( 0 ), _WBSize( 0 ), _Writing( false ), _Reads( 0 ), _Version( 0 ), _Downloading( false )
 {
 }
@@ -617,7 +1257,9 @@ File::~File()
 {
 	// !! must be locked when deleted !!
 	
-	delete[] _Data;
+	if ( _DataBuf )
+		_DataBuf->Release();
+	
 	delete[] _WriteBuff;
 	delete _Clique;
 		
@@ -731,7 +1373,7 @@ int File::Read( void *data, unsigned int size, unsigned int offset )
 	int end = offset+size;
 	
 	int timeout = time(NULL) + 10 + (end-_Recvd)/(1<<24);
-	while ( _Downloading && _Recvd < end && timeout > time(NULL) )
+	while ( _Downloading && !IsAvailable( offset, end ) && timeout > time(NULL) )
 	{
 		// wait for the network to get the data we need
 		sched_yield();
@@ -743,13 +1385,7 @@ int File::Read( void *data, unsigned int size, unsigned int offset )
 	
 	Lock();
 	
-	if ( _Recvd < end )
-	{
-		if ( _Recvd < offset )
-			size = 0;
-		else
-			size = _Recvd - offset;
-	}
+	size = Available( offset, end ) - offset;
 	
 	if ( size > 0 )
 		memcpy( data, &_Data[offset], size );
@@ -765,18 +1401,20 @@ int File::Write( const void *data, unsigned int size, unsigned int offset )
 	
 	size_t end = offset + size;
 	
-	cout << "Write s:" << size << " at o:" << offset << " -- LocalSize = " << _LocalSize << endl;
+	LOG( LOG_DEBUG, "Write s:" << size << " at o:" << offset << " -- LocalSize = " << _LocalSize );
 	
 	if ( offset >= _LocalSize ) // trying to write past the end means appending
 	{
-		cout << "Append! " << DRMManager->CanAppend( this ) << endl;
-		if ( !DRMManager->CanAppend( this ) )
+		bool allowed = DRMManager->CanAppend( this );
+		LOG( LOG_DEBUG, "Append! " << allowed );
+		if ( !allowed )
 			return -EACCES; 
 	}
 	else
 	{
-		cout << "Write! " << DRMManager->CanWrite( this ) << endl;
-		if ( !DRMManager->CanWrite( this ) )
+		bool allowed = DRMManager->CanWrite( this );
+		LOG( LOG_DEBUG, "Write! " << allowed );
+		if ( !allowed )
 			return -EACCES; 
 	}
 	
@@ -811,22 +1449,17 @@ void File::Flush()
 
 	Lock();
 		
-	if ( _Data )
-		delete[] _Data;
-	
 	if ( _WriteBuff )
 	{
-		_Data = new char[_WBCap];	
+		AllocData( _WBCap );
 		memcpy( _Data, _WriteBuff, _WBSize );
 		
-		_Capacity = _WBCap;
 		_Recvd = _LocalSize = _Size = _WBSize;
 	}
 	else
 	{
-		_Data = new char[BUFF_BLOCK_SIZE];
+		AllocData( BUFF_BLOCK_SIZE );
 		
-		_Capacity = BUFF_BLOCK_SIZE;
 		_Recvd = _Size = _LocalSize = 0;
 	}
 	
@@ -834,3 +1467,262 @@ void File::Flush()
 	
 	Unlock();
 }
+
+void File::AllocData( off_t capacity )
+{
+	// anyone still sending out of the old buffer keeps it alive until they're done
+	if ( _DataBuf )
+		_DataBuf->Release();
+	
+	_DataBuf = SharedBuffer::Alloc( capacity );
+	_Data = _DataBuf->Data();
+	_Capacity = capacity;
+}
+
+off_t File::Available( off_t offset, off_t end )
+{
+	off_t pos = offset;
+	
+	if ( pos < _Recvd )
+		pos = _Recvd < end ? _Recvd : end;
+	
+	if ( _Downloading )
+	{
+		// blocks past the watermark may have come in out of order
+		while ( pos < end )
+		{
+			unsigned int block = pos / BUFF_BLOCK_SIZE;
+			
+			if ( block >= _Blocks.size() || !_Blocks[block] )
+				break;
+			
+			pos = (off_t)( block + 1 ) * BUFF_BLOCK_SIZE;
+		}
+	}
+	
+	return pos < end ? pos : end;
+}
+
+void File::MarkReceived( off_t offset, off_t end )
+{
+	for ( unsigned int block = ( offset + BUFF_BLOCK_SIZE - 1 ) / BUFF_BLOCK_SIZE; block < _Blocks.size(); block++ )
+	{
+		off_t blockEnd = (off_t)( block + 1 ) * BUFF_BLOCK_SIZE;
+		
+		if ( blockEnd > _Size )
+			blockEnd = _Size;
+		
+		if ( blockEnd > end )
+			break;
+		
+		_Blocks[block] = true;
+	}
+	
+	while ( _Recvd < _Size && (unsigned int)( _Recvd / BUFF_BLOCK_SIZE ) < _Blocks.size() && _Blocks[ _Recvd / BUFF_BLOCK_SIZE ] )
+	{
+		_Recvd = ( _Recvd / BUFF_BLOCK_SIZE + 1 ) * BUFF_BLOCK_SIZE;
+		
+		if ( _Recvd > _Size )
+			_Recvd = _Size;
+	}
+}
+
+
+
+TreeWalker::TreeWalker( const string &after )
+{
+	Push( FileSystem::GetRoot(), "" );
+	
+	string::size_type pos = 1;
+	
+	while ( pos < after.size() )
+	{
+		string::size_type end = after.find( '/', pos );
+		if ( end == string::npos )
+			end = after.size();
+		
+		string name = after.substr( pos, end - pos );
+		Frame &top = _Stack.back();
+		
+		FSListIter iter = top.folder->Locate( name.c_str() );
+		
+		if ( iter == top.folder->GetList().end() )
+			return;
+		
+		FSObject *obj = *iter;
+		top.next = ++iter;
+		
+		if ( obj->IsFolder() )
+			Push( (Folder*)obj, top.path + "/" + name );
+		else
+			return;
+		
+		pos = end + 1;
+	}
+}
+
+FSObject *TreeWalker::Next( string &path )
+{
+	while ( !_Stack.empty() )
+	{
+		Frame &top = _Stack.back();
+		
+		if ( top.next == top.folder->GetList().end() )
+		{
+			_Stack.pop_back();
+			continue;
+		}
+		
+		FSObject *obj = *top.next;
+		top.next++;
+		
+		path = top.path + "/" + obj->Name();
+		
+		if ( obj->IsFolder() )
+			Push( (Folder*)obj, path );
+		
+		return obj;
+	}
+	
+	return NULL;
+}
+
+void TreeWalker::Push( Folder *folder, const string &path )
+{
+	Frame f;
+	f.folder = folder;
+	f.next = folder->GetList().begin();
+	f.path = path;
+	
+	_Stack.push_back( f );
+}
+
+static unsigned int ZigZag( int val ) { return ( (unsigned int)val << 1 ) ^ (unsigned int)( val >> 31 ); }
+static int UnZigZag( unsigned int val ) { return (int)( val >> 1 ) ^ -(int)( val & 1 ); }
+
+void EntryWriter::Write( FSObject *obj, const string &path )
+{
+	unsigned int shared = 0;
+	while ( shared < _Last.size() && shared < path.size() && _Last[shared] == path[shared] )
+		shared++;
+	
+	_Packet.WriteVarint( shared );
+	_Packet.WriteASCII( path.c_str() + shared );
+	_Packet.WriteByte( obj->Type() );
+	_Packet.WriteVarint( obj->Mode() );
+	_Packet.WriteVarint( ZigZag( (int)( obj->mTime() - _MTime ) ) );
+	_Packet.WriteVarint( ZigZag( (int)( obj->cTime() - _CTime ) ) );
+	
+	_Last = path;
+	_MTime = obj->mTime();
+	_CTime = obj->cTime();
+	
+	if ( obj->IsFile() )
+	{
+		File *file = (File*)obj;
+		AddressList members = file->GetClique()->Members();
+		
+		_Packet.WriteVarint( file->Size() );
+		_Packet.WriteVarint( members.size() );
+		
+		for ( AddressList::iterator iter = members.begin(); iter != members.end(); iter++ )
+		{
+			map<NetAddress, unsigned int>::iterator found = _Dict.find( *iter );
+			
+			if ( found != _Dict.end() )
+			{
+				_Packet.WriteVarint( found->second );
+			}
+			else
+			{
+				// first time this packet mentions it, the next index plus the address itself
+				unsigned int index = _Dict.size();
+				_Dict.insert( make_pair( *iter, index ) );
+				
+				_Packet.WriteVarint( index );
+				_Packet.WriteAddress( *iter );
+			}
+		}
+	}
+}
+
+bool EntryReader::Read( FSEntry &e )
+{
+	char temp[MAX_PATH];
+	
+	if ( _Reader.AtEnd() )
+		return false;
+	
+	unsigned int shared = _Reader.ReadVarint();
+	if ( shared > _Last.size() )
+		return false;
+	
+	_Reader.ReadASCII( temp, MAX_PATH );
+	
+	e.path.assign( _Last, 0, shared );
+	e.path += temp;
+	e.type = (unsigned char)_Reader.ReadByte();
+	e.mode = _Reader.ReadVarint();
+	e.mtime = _MTime + UnZigZag( _Reader.ReadVarint() );
+	e.ctime = _CTime + UnZigZag( _Reader.ReadVarint() );
+	e.size = 0;
+	e.members.clear();
+	
+	_Last = e.path;
+	_MTime = e.mtime;
+	_CTime = e.ctime;
+	
+	if ( e.type == DT_REG )
+	{
+		e.size = _Reader.ReadVarint();
+		
+		unsigned int count = _Reader.ReadVarint();
+		
+		for ( unsigned int i = 0; i < count && !_Reader.AtEnd(); i++ )
+		{
+			unsigned int index = _Reader.ReadVarint();
+			
+			if ( index == _Dict.size() )
+				_Dict.push_back( _Reader.ReadAddress() );
+			else if ( index > _Dict.size() )
+				return false;
+			
+			e.members.push_back( _Dict[index] );
+		}
+	}
+	
+	return true;
+}
+
+bool EntryReader::ReadV1( PacketReader &reader, FSEntry &e )
+{
+	char name[MAX_PATH];
+	unsigned int attrs[3];
+	
+	if ( reader.AtEnd() )
+		return false;
+	
+	reader.ReadASCII( name, MAX_PATH );
+	
+	e.path = name;
+	e.type = reader.ReadByte();
+	
+	if ( !reader.ReadUnsignedInts( attrs, 3 ) )
+		return false;
+	
+	e.mode = attrs[0];
+	e.mtime = attrs[1];
+	e.ctime = attrs[2];
+	
+	e.size = 0;
+	e.members.clear();
+	
+	if ( e.type == DT_REG )
+	{
+		e.size = reader.ReadUnsignedInt();
+		
+		reader.ReadAddresses( e.members, reader.ReadInt() );
+	}
+	
+	return true;
+}
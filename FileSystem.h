@@ -21,15 +21,20 @@
 #define __FILE_SYSTEM_H_
 
 #include <list>
+#include <map>
 #include <queue>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <tr1/unordered_map>
+#include <tr1/unordered_set>
 
 #include <string.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include "Buddy.h"
+#include "Buffer.h"
+#include "Mutex.h"
 #include "Request.h"
 #include "drm.h"
 
@@ -37,14 +42,54 @@ using namespace std;
 
 #define LOCAL_CACHE_DURATION 5
 #define BUFF_BLOCK_SIZE 4096
+#define PATH_CACHE_MAX 65536 // paths FindObject() remembers before it starts over
+#define MISS_CACHE_DURATION LOCAL_CACHE_DURATION // secs a "no such file" from the alpha is believed
+#define MISS_CACHE_MAX 16384 // missing paths remembered before starting over
+#define LEASE_BROKEN 1 // _Expire of something the alpha took back, GetObject() fetches it again before handing it out
 
 class FileSystem;
 class FSObject;
 class Folder; 
 class File;
+class EntryWriter;
+struct FSEntry;
 
 typedef list<FSObject*> FSList;
-typedef FSList::iterator FSListIter;
+typedef FSList::const_iterator FSListIter;
+
+// children are hashed by name, keyed on the child's own copy of its name
+struct NameHash
+{
+	size_t operator()( const char *name ) const
+	{
+		size_t h = 2166136261u; // FNV-1a
+		while ( *name )
+			h = ( h ^ (unsigned char)*name++ ) * 16777619u;
+		return h;
+	}
+};
+
+struct NameEqual
+{
+	bool operator()( const char *a, const char *b ) const { return !strcmp( a, b ); }
+};
+
+typedef std::tr1::unordered_map<const char *, FSList::iterator, NameHash, NameEqual> FSIndex;
+
+// the path is kept alongside so a hash collision just looks like a miss
+struct PathEntry
+{
+	string path;
+	FSObject *obj;
+};
+
+typedef std::tr1::unordered_map<unsigned long long, PathEntry> PathCache;
+
+typedef multimap<int, FSObject *> ExpiryQueue; // when it's due -> what's due, so the front is always the next one
+
+// grouped by folder, so a create in a folder forgets everything it might have made
+typedef std::tr1::unordered_map<string, time_t> MissNames; // name -> when to stop believing it's missing
+typedef std::tr1::unordered_map<string, MissNames> MissCache; // folder path -> names the alpha said it doesn't have
 
 class FileSystem
 {
@@ -53,30 +98,73 @@ public:
 	static void SaveLocal();
 	
 	static void Slice();
-	static bool RecurseExpire( FSObject * );
 	
 	static FSObject *GetObject( const char *path ); // path is assumed to be rooted at /, even if it doesnt begin with a /
+	static FSObject *FindObject( const char *path ); // like GetObject, but never asks the alpha
+	static Folder *ListFolder( const char *path ); // GetObject for a folder and everything in it, so a readdir and the stats after it are local. NULL with errno set if it can't be listed
 	static FSObject *AddObject( const char *path, int type, bool brokenPaths = false ); // if brokenPaths is true, then there may be previously unknown folders in the path we're adding
 	static void RemoveObject( FSObject *obj );
 	
 	static void CacheObject( FSObject *obj, int time = 5 );
+	static void Unschedule( FSObject *obj ); // take obj out of the expiry queue, it's going away
+	static void Emptied( Folder *fld ); // something left fld, if it was the last thing and fld is past due it goes now
 	
 	static void BuildList( list<string> &lst, FSObject *obj = (FSObject*)_Root, string path = "" );
 	static void WriteFullList( Packet &p, FSObject *obj = (FSObject*)_Root, string path = "" );
+	static void WriteFullList( EntryWriter &w, FSObject *obj = (FSObject*)_Root, string path = "" ); // v2 encoding
+	
+	static FSObject *ApplyEntry( const FSEntry &e ); // create or update the object an entry from the alpha describes
+	
+	static int EntrySize( FSObject *obj, int nameLen ); // bytes WriteFullList() and LIST_RESP spend on obj, not counting its children
+	static int ListSize( FSObject *obj = (FSObject*)_Root, int pathLen = 0 ); // bytes WriteFullList() will write for obj and everything under it
 	
 	static Folder *GetRoot() { return _Root; }
 	
+	static int Normalize( const char *path, char *out ); // "/a/b" the way FullPath() has it, however many /s path had. out holds MAX_PATH, returns the length
+	static unsigned long long PathHash( const char *path, int len );
+	static void Uncache( FSObject *obj ); // forget the paths to obj, and everything under it, before it's moved or deleted
+	
+	static bool KnownMissing( const char *path ); // the alpha said path doesn't exist less than MISS_CACHE_DURATION ago
+	static void Missing( const char *path );
+	static void Appeared( const char *path = NULL ); // something turned up in path's folder, NULL if we can't tell which folder
+	
+	static void BreakLease( const char *path, bool tree = false ); // the alpha says what we have for path is out of date, and with tree everything under it too
+	static void DropLeases(); // we lost an alpha, and with it anyone who'd tell us about changes
+	
 private:
 	static void RecurseSave( FSObject *obj, ofstream &data );
 	
+	static void Schedule( FSObject *obj, int when ); // look at obj again once when has passed
+	static void ExpireDue(); // drops whatever has expired, touching nothing else
+	static void ClearExpiry();
+	static void Reap( FSObject *obj, time_t now ); // drops obj, then its folders, for as long as they're expired and empty
+	static void BreakObject( FSObject *obj );
+	
 	static Folder *_Root;
 	static int _LastSave;
+	
+	static PathCache _Paths; // full path hash -> object, so a lookup that's been done before is one probe
+	static Mutex _PathMutex;
+	
+	static bool SplitMissing( const char *path, string &folder, string &name );
+	static void ForgetMissing( const string &folder );
+	static void RecurseDrop( FSObject *obj );
+	static bool InUse( FSObject *obj ); // obj is a local or open file, or a folder with one somewhere under it
+	
+	static void Lease( FSObject *obj, int secs ); // cache obj for the lease the alpha gave with it, 0 if none
+	
+	static MissCache _Misses;
+	static int _MissCount;
+	static Mutex _MissMutex;
+	
+	static ExpiryQueue _Expiry;
+	static Mutex _ExpiryMutex;
 };
 
 class FSObject
 {
 public:
-	explicit FSObject( const char *name, int type, FSObject *parent ) : _Parent( parent ), _Type( type ), _Name( NULL ), _Expire( 0 )
+	explicit FSObject( const char *name, int type, FSObject *parent ) : _Parent( parent ), _Type( type ), _Name( NULL ), _Expire( 0 ), _Queued( false )
 	{
 		int len = strlen( name )+1;
 		_Name = new char[len];
@@ -89,6 +177,8 @@ public:
 	
 	virtual ~FSObject()
 	{
+		FileSystem::Unschedule( this );
+		
 		delete[] _Name;
 	}
 	
@@ -97,7 +187,7 @@ public:
 	
 	int Type() const { return _Type; }
 	const char *Name() const { return _Name; }
-	void Name(const char *name) 
+	void Name(const char *name) // only while it's out of its folder, the folder's index is keyed on _Name
 	{
 		int len = strlen( name )+1;
 		delete[] _Name;
@@ -134,6 +224,9 @@ private:
 	char* _Name;
 	int _Expire;
 	
+	bool _Queued;
+	ExpiryQueue::iterator _Due; // our place in the expiry queue, if _Queued
+	
 	mode_t _Mode;
 	time_t _mTime, _cTime;
 };
@@ -150,14 +243,20 @@ public:
 	{
 	}
 		
-	FSList &GetList() { return _List; }
-	
-	virtual bool IsLocal() { return false; }
+	// children in the order they were added, which is the order LIST_RESP and the tree go out in
+	const FSList &GetList() const { return _List; }
+	int Count() const { return _Index.size(); }
 	
+	FSObject *Find( const char *name ) const;
+	FSListIter Locate( const char *name ) const; // GetList().end() if there's no such child
+	bool Add( FSObject *obj ); // false if there's already a child by that name
+	void Remove( FSObject *obj );
 	
+	virtual bool IsLocal() { return false; }
 	
 private:
 	FSList _List;
+	FSIndex _Index; // name -> where it sits in _List
 };
 
 class File : public FSObject, public Mutex
@@ -195,14 +294,22 @@ public:
 	int Version() const { return _Version; }
 	void Version( int ver ) { _Version = ver; }
 	
+	off_t Available( off_t offset, off_t end ); // end of the run of received data starting at offset, at most end
+	bool IsAvailable( off_t offset, off_t end ) { return Available( offset, end ) >= end; }
+	
 private:
 	friend class FileSystem;
 	friend class FileStorageClique;
 	friend class DRM;
 	
+	void MarkReceived( off_t offset, off_t end ); // must be locked
+	void AllocData( off_t capacity ); // must be locked, drops the old contents
+	SharedBuffer *PinData() { return _DataBuf ? _DataBuf->Ref() : NULL; } // must be locked, caller releases
+	
 	FileStorageClique *_Clique;
 	off_t _Size, _Capacity, _Recvd, _LocalSize;
-	char *_Data;
+	char *_Data; // points into _DataBuf
+	SharedBuffer *_DataBuf;
 	char *_WriteBuff;
 	off_t _WBCap, _WBSize;
 	
@@ -214,6 +321,73 @@ private:
 	int _Version;
 	
 	bool _Downloading;
+	vector<bool> _Blocks; // which BUFF_BLOCK_SIZE blocks have arrived while _Downloading, _Recvd is the contiguous prefix
+};
+
+// walks the namespace in the same order as WriteFullList(), one object at a time, and can
+// pick up again right after a given path. if that path has gone away in the meantime we
+// start over at the last folder of it that's still there, entries are safe to resend.
+class TreeWalker
+{
+public:
+	explicit TreeWalker( const string &after = "" );
+	
+	FSObject *Next( string &path ); // NULL once we're out of objects
+	
+private:
+	struct Frame
+	{
+		Folder *folder;
+		FSListIter next;
+		string path;
+	};
+	
+	void Push( Folder *folder, const string &path );
+	
+	vector<Frame> _Stack;
+};
+
+// one namespace entry as it travels in LIST_RESP, FS_RESP and MAKE_ALPHA
+struct FSEntry
+{
+	string path; // a full path, or just the name in a LIST_RESP
+	int type;
+	unsigned int mode, mtime, ctime;
+	unsigned int size; // files only
+	AddressList members; // files only
+};
+
+// v2 encoding for a run of entries in one packet: varints, each path front-coded against
+// the one before it, times as deltas, and each replica address written out once and
+// referred to by index after that. a v2 body starts with PACKET_V2_MARK.
+class EntryWriter
+{
+public:
+	explicit EntryWriter( Packet &p ) : _Packet( p ), _MTime( 0 ), _CTime( 0 ) {}
+	
+	void Write( FSObject *obj, const string &path );
+	
+private:
+	Packet &_Packet;
+	string _Last;
+	unsigned int _MTime, _CTime;
+	map<NetAddress, unsigned int> _Dict;
+};
+
+class EntryReader
+{
+public:
+	explicit EntryReader( PacketReader &reader ) : _Reader( reader ), _MTime( 0 ), _CTime( 0 ) {}
+	
+	bool Read( FSEntry &e ); // false once the packet runs out
+	
+	static bool ReadV1( PacketReader &reader, FSEntry &e ); // one entry the way peers before v2 write them
+	
+private:
+	PacketReader &_Reader;
+	string _Last;
+	unsigned int _MTime, _CTime;
+	vector<NetAddress> _Dict;
 };
 
 #endif
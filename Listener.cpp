@@ -17,12 +17,14 @@
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
 
 #include "Listener.h"
 #include "Socket.h"
+#include "Log.h"
 
 Listener::Listener() : _Socket( 0 )
 {}
@@ -60,61 +62,52 @@ bool Listener::Listen( unsigned short port )
 		Close();
 		return false;
 	}
+	
+	int on = 1;
+	ioctl( _Socket, FIONBIO, &on );
+	
+	Socket::AddListener( this );
 
 	return true;
 }
 
+// accepting is driven by Socket::Slice() now, this only reports whether we are still listening
 bool Listener::Slice( int u_timeout )
 {
-	int val;
-	
-	do {
-		fd_set read, except;
-		timeval timeout;
-
-		timeout.tv_sec = 0;
-		timeout.tv_usec = u_timeout;
-
-		FD_ZERO( &read );
-		FD_ZERO( &except );
+	return _Socket > 0;
+}
 
-		FD_SET( _Socket, &read );
-		FD_SET( _Socket, &except );
-		
-		val = select( _Socket + 1, &read, NULL, &except, &timeout );
+void Listener::OnReadable()
+{
+	for (;;)
+	{
+		sockaddr_in addr;
+		socklen_t len = sizeof( sockaddr_in );
+		int newSock = accept( _Socket, (sockaddr*)&addr, &len );
 		
-		if ( val < 0 )
+		if ( newSock > 0 )
 		{
-			Close();
-			return false;
+			OnAccept( newSock, addr );
 		}
-	
-		if ( val > 0 )
+		else
 		{
-			if ( FD_ISSET( _Socket, &except ) )
-				return false;
-	
-			if ( FD_ISSET( _Socket, &read ) )
-			{
-				sockaddr_in addr;
-				socklen_t len = sizeof( sockaddr_in );
-				int newSock = accept( _Socket, (sockaddr*)&addr, &len );
-	
-				if ( newSock > 0 )
-					OnAccept( newSock, addr );
-				else
-					cout << "Error on accept: " << strerror(errno) << endl;
-			}
+			// edge triggered, so drain the backlog until it would block
+			if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+				LOG( LOG_ERROR, "Error on accept: " << strerror(errno) );
+			
+			if ( errno != EINTR )
+				break;
 		}
-	} while ( val > 0 );
-
-	return true;
+	}
 }
 
 void Listener::Close()
 {
 	if ( _Socket > 0 )
+	{
+		Socket::RemoveListener( this );
 		close( _Socket );
+	}
 	_Socket = 0;
 }
 
@@ -126,6 +119,7 @@ int Listener::FD() const
 void Listener::OnAccept( int sock, sockaddr_in addr )
 {
 	Socket *s = new Socket();
+	s->Pin( Socket::NextShard() ); // spread incoming peers over the I/O threads
 	s->Attach( sock, addr );
 	s->OnAccepted();
 }
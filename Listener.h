@@ -34,6 +34,7 @@ public:
 
 	int FD() const;
 
+	void OnReadable(); // called from Socket::Slice() when connections are waiting
 	void OnAccept( int sock, sockaddr_in addr );
 
 private:
@@ -0,0 +1,234 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+using namespace std;
+
+#include "Log.h"
+
+#define LOG_RING_MASK ( LOG_RING_SIZE - 1 )
+
+Log Log::_Writer;
+vector<LogRing *> Log::_Rings;
+Mutex Log::_Mutex;
+pthread_key_t Log::_Key;
+pthread_once_t Log::_Once = PTHREAD_ONCE_INIT;
+volatile int Log::_Level = LOG_MIN_LEVEL;
+
+static const char LevelTags[] = { 'D', 'I', 'W', 'E' };
+
+void LogRing::Copy( unsigned int pos, const void *src, int len )
+{
+	unsigned int start = pos & LOG_RING_MASK;
+	int first = LOG_RING_SIZE - start < (unsigned int)len ? LOG_RING_SIZE - start : len;
+
+	memcpy( &_Data[start], src, first );
+	memcpy( _Data, (const char *)src + first, len - first );
+}
+
+void LogRing::Fetch( unsigned int pos, void *dest, int len )
+{
+	unsigned int start = pos & LOG_RING_MASK;
+	int first = LOG_RING_SIZE - start < (unsigned int)len ? LOG_RING_SIZE - start : len;
+
+	memcpy( dest, &_Data[start], first );
+	memcpy( (char *)dest + first, _Data, len - first );
+}
+
+void LogRing::Put( int level, const char *text, int len )
+{
+	Record r;
+	timeval now;
+
+	gettimeofday( &now, NULL );
+
+	if ( len > LOG_LINE_MAX )
+		len = LOG_LINE_MAX;
+
+	r.sec = now.tv_sec;
+	r.usec = now.tv_usec;
+	r.len = len;
+	r.level = level;
+
+	unsigned int head = _Head;
+
+	if ( LOG_RING_SIZE - ( head - _Tail ) < sizeof(Record) + len )
+	{
+		__sync_fetch_and_add( &_Dropped, 1 );
+		return;
+	}
+
+	Copy( head, &r, sizeof(Record) );
+	Copy( head + sizeof(Record), text, len );
+
+	// the writer mustn't see the new head before the bytes it covers
+	__sync_synchronize();
+	_Head = head + sizeof(Record) + len;
+}
+
+bool LogRing::Get( int &level, timeval &when, char *text, int &len )
+{
+	unsigned int tail = _Tail;
+
+	if ( tail == _Head )
+		return false;
+
+	__sync_synchronize();
+
+	Record r;
+	Fetch( tail, &r, sizeof(Record) );
+	Fetch( tail + sizeof(Record), text, r.len );
+
+	level = r.level;
+	when.tv_sec = r.sec;
+	when.tv_usec = r.usec;
+	len = r.len;
+
+	// done reading before the producer is allowed to write over it
+	__sync_synchronize();
+	_Tail = tail + sizeof(Record) + r.len;
+
+	return true;
+}
+
+
+
+void Log::Init()
+{
+	pthread_key_create( &_Key, ThreadDone );
+
+	_Writer.StartThread();
+	atexit( Flush );
+}
+
+void Log::ThreadDone( void *ring )
+{
+	((LogRing *)ring)->Kill();
+}
+
+LogRing *Log::Ring()
+{
+	pthread_once( &_Once, Init );
+
+	LogRing *ring = (LogRing *)pthread_getspecific( _Key );
+
+	if ( ring == NULL )
+	{
+		ring = new LogRing();
+		pthread_setspecific( _Key, ring );
+
+		_Mutex.Lock();
+		_Rings.push_back( ring );
+		_Mutex.Unlock();
+	}
+
+	return ring;
+}
+
+void Log::Write( int level, const char *text, int len )
+{
+	Ring()->Put( level, text, len );
+}
+
+void Log::Flush()
+{
+	while ( Drain() )
+		;
+}
+
+bool Log::Drain()
+{
+	char text[LOG_LINE_MAX];
+	string out;
+
+	_Mutex.Lock();
+
+	for ( unsigned int i = 0; i < _Rings.size(); )
+	{
+		LogRing *ring = _Rings[i];
+		unsigned int dropped = ring->TakeDropped();
+		int level, len;
+		timeval when;
+
+		if ( dropped )
+		{
+			sprintf( text, "-- %u log lines dropped --\n", dropped );
+			out += text;
+		}
+
+		while ( ring->Get( level, when, text, len ) )
+		{
+			char stamp[32];
+			time_t sec = when.tv_sec;
+			tm local;
+
+			localtime_r( &sec, &local );
+			sprintf( stamp, "%02d:%02d:%02d.%03d %c ", local.tm_hour, local.tm_min, local.tm_sec, (int)( when.tv_usec / 1000 ), LevelTags[ level & 3 ] );
+
+			out += stamp;
+			out.append( text, len );
+
+			if ( len == 0 || text[len-1] != '\n' )
+				out += '\n';
+		}
+
+		// nothing more is coming from a thread that's gone
+		if ( ring->IsDead() && ring->IsEmpty() )
+		{
+			_Rings.erase( _Rings.begin() + i );
+			delete ring;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	// one write for the whole pass, still under the lock so passes don't interleave
+	for ( unsigned int done = 0; done < out.size(); )
+	{
+		int n = write( STDOUT_FILENO, out.data() + done, out.size() - done );
+
+		if ( n <= 0 )
+			break;
+
+		done += n;
+	}
+
+	_Mutex.Unlock();
+
+	return !out.empty();
+}
+
+int Log::ThreadMain()
+{
+	for (;;)
+	{
+		if ( !Drain() )
+			usleep( LOG_FLUSH_INTERVAL );
+	}
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __LOG_H_
+#define __LOG_H_
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <vector>
+#include <ostream>
+#include <streambuf>
+
+#include "Mutex.h"
+#include "Thread.h"
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO // build with -DLOG_MIN_LEVEL=0 to get the debug lines back, below this they aren't even compiled in
+#endif
+
+#define LOG_LINE_MAX 1024 // longer lines are cut off
+#define LOG_RING_SIZE (64*1024) // bytes of unwritten lines each thread can have, past that lines are dropped, power of two
+#define LOG_FLUSH_INTERVAL 20000 // usecs the writer sleeps when there's nothing to write
+
+// LOG( LOG_INFO, addr << ": Connected." ). formats into a stack buffer and copies it into the calling thread's
+// ring, the writer thread does the actual I/O. the level is a constant, so anything under LOG_MIN_LEVEL folds away.
+#define LOG( level, expr ) \
+	do \
+	{ \
+		if ( (level) >= LOG_MIN_LEVEL && (level) >= Log::Level() ) \
+		{ \
+			LogLine _line( level ); \
+			_line.Stream() << expr; \
+		} \
+	} while ( 0 )
+
+// single producer single consumer byte ring, the producer is the thread it belongs to and the consumer is the writer
+class LogRing
+{
+public:
+	LogRing() : _Head( 0 ), _Tail( 0 ), _Dropped( 0 ), _Dead( false ) {}
+
+	void Put( int level, const char *text, int len ); // never blocks, drops the line if there's no room
+	bool Get( int &level, timeval &when, char *text, int &len ); // text must hold LOG_LINE_MAX
+
+	unsigned int TakeDropped() { return __sync_lock_test_and_set( &_Dropped, 0 ); }
+
+	bool IsEmpty() const { return _Head == _Tail; }
+	bool IsDead() const { return _Dead; }
+	void Kill() { _Dead = true; }
+
+private:
+	struct Record
+	{
+		unsigned int sec, usec;
+		unsigned short len;
+		unsigned char level;
+	};
+
+	void Copy( unsigned int pos, const void *src, int len );
+	void Fetch( unsigned int pos, void *dest, int len );
+
+	char _Data[LOG_RING_SIZE];
+	volatile unsigned int _Head, _Tail; // only ever count up, wrap by masking
+	volatile unsigned int _Dropped;
+	volatile bool _Dead; // its thread exited, free it once it's drained
+};
+
+class Log : public Thread
+{
+public:
+	static int Level() { return _Level; }
+	static void Level( int level ) { _Level = level; }
+
+	static void Write( int level, const char *text, int len );
+	static void Flush(); // writes out whatever every thread has queued, from the calling thread
+
+private:
+	Log() {}
+
+	virtual int ThreadMain();
+
+	static LogRing *Ring(); // this thread's, made on first use
+	static void Init();
+	static void ThreadDone( void *ring );
+	static bool Drain(); // false if there was nothing to write
+
+	static Log _Writer;
+	static std::vector<LogRing *> _Rings;
+	static Mutex _Mutex; // guards _Rings, and keeps two drains from interleaving
+	static pthread_key_t _Key;
+	static pthread_once_t _Once;
+	static volatile int _Level;
+};
+
+// a streambuf over a fixed array, so formatting a line never touches the heap
+class LogBuf : public std::streambuf
+{
+public:
+	LogBuf() { setp( _Buff, _Buff + LOG_LINE_MAX - 1 ); }
+
+	const char *Data() const { return _Buff; }
+	int Length() const { return pptr() - _Buff; }
+
+private:
+	char _Buff[LOG_LINE_MAX];
+};
+
+class LogLine
+{
+public:
+	explicit LogLine( int level ) : _Level( level ), _Out( &_Buf ) {}
+	~LogLine() { Log::Write( _Level, _Buf.Data(), _Buf.Length() ); }
+
+	std::ostream &Stream() { return _Out; }
+
+private:
+	int _Level;
+	LogBuf _Buf;
+	std::ostream _Out;
+};
+
+#endif
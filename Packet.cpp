@@ -26,52 +26,64 @@
 
 void HexDump( ostream &out, const char *data, int len );
 
+unsigned int Packet::_LastID = 0;
+
+unsigned int Packet::NewRequestID()
+{
+	unsigned int id;
+	
+	do
+	{
+		id = __sync_add_and_fetch( &_LastID, 1 );
+	} while ( id == 0 ); // 0 means "make one up" to the constructor
+	
+	return id;
+}
+
 Packet::Packet( int cmd, int reqID, int len )
 {
 	if ( len < PAYLOAD_BEGIN )
 		len = 64;
 	
-	_Buff = new char[len];
+	_Shared = SharedBuffer::Alloc( len );
+	_Buff = _Shared->Data();
 	
 	_Buff[0] = (char)cmd;
-	_MaxLen = len;
+	_MaxLen = (int)_Shared->Size();
 	_Len = _Pos = PAYLOAD_BEGIN - 4;
 	
 	if ( reqID == 0 )
-		WriteInt( rand() );
+		WriteUnsignedInt( NewRequestID() );
 	else
 		WriteInt( reqID );
 }
 
-Packet::Packet( const Packet &cpy )
+Packet::Packet( SharedBuffer *buff, char *frame, int len ) : _Shared( buff->Ref() ), _Buff( frame ), _MaxLen( len ), _Len( len ), _Pos( len )
 {
-	_MaxLen = cpy._MaxLen;
-	_Len = cpy._Len;
-	_Pos = cpy._Pos;
-	
-	_Buff = new char[_MaxLen];
+}
 
-	memcpy( _Buff, cpy._Buff, _Len );
+Packet::Packet( const Packet &cpy ) : _Shared( cpy._Shared->Ref() ), _Buff( cpy._Buff ), _MaxLen( cpy._MaxLen ), _Len( cpy._Len ), _Pos( cpy._Pos )
+{
 }
 
 Packet::~Packet()
 {
-	delete[] _Buff;
+	_Shared->Release();
 }
 
 const Packet &Packet:: operator = ( const Packet &cpy )
 {
 	if ( this != &cpy )
 	{
-		delete[] _Buff;
+		SharedBuffer *old = _Shared;
 		
+		_Shared = cpy._Shared->Ref();
+		_Buff = cpy._Buff;
 		_MaxLen = cpy._MaxLen;
 		_Len = cpy._Len;
 		_Pos = cpy._Pos;
-	
-		_Buff = new char[_MaxLen];
-
-		memcpy( _Buff, cpy._Buff, _Len );
+		
+		old->Release();
 	}
 	
 	return *this;
@@ -79,17 +91,33 @@ const Packet &Packet:: operator = ( const Packet &cpy )
 
 const char *Packet::Buffer()
 {
-	int oldPos = _Pos;
-	_Pos = 1;
-	WriteInt( _Len );
-	_Pos = oldPos;
+	// only touch the header if the length changed, a shared frame is usually already final
+	if ( (int)ntohl( *((unsigned int *)&_Buff[1]) ) != _Len )
+	{
+		Own( _MaxLen );
+		*((unsigned int *)&_Buff[1]) = htonl( (unsigned int)_Len );
+	}
 
 	return _Buff;
 }
 
+SharedBuffer *Packet::Share( int &offset )
+{
+	Buffer();
+	
+	offset = _Buff - _Shared->Data();
+	return _Shared->Ref();
+}
+
 PacketReader Packet::MakeReader()
 {
-	return PacketReader( Buffer() );
+	int offset;
+	SharedBuffer *buff = Share( offset );
+	
+	PacketReader reader( buff, offset );
+	buff->Release();
+	
+	return reader;
 }
 
 void Packet::WriteRaw( const void *ptr, int len )
@@ -111,6 +139,19 @@ void Packet::WriteAddress( const NetAddress &addr )
 	WriteShort( addr.Port() );
 }
 
+void Packet::WriteAddresses( const AddressList &list )
+{
+	// one bounds check for the lot
+	PreWrite( list.size() * 6 );
+	
+	for( AddressList::const_iterator iter = list.begin(); iter != list.end(); iter++ )
+	{
+		*((unsigned int *)&_Buff[_Pos]) = htonl( (unsigned int)iter->IP() );
+		*((unsigned short *)&_Buff[_Pos+4]) = htons( iter->Port() );
+		_Pos += 6;
+	}
+}
+
 void Packet::WriteInt( int val )
 {
 	PreWrite( 4 );
@@ -127,6 +168,17 @@ void Packet::WriteUnsignedInt( unsigned int val )
 	_Pos += 4;
 }
 
+void Packet::WriteUnsignedInts( const unsigned int *vals, int count )
+{
+	PreWrite( count * 4 );
+	
+	unsigned int *out = (unsigned int *)&_Buff[_Pos];
+	for ( int i = 0; i < count; i++ )
+		out[i] = htonl( vals[i] );
+	
+	_Pos += count * 4;
+}
+
 void Packet::WriteShort( short val )
 {
 	PreWrite( 2 );
@@ -143,50 +195,71 @@ void Packet::WriteByte( char val )
 	_Pos++;
 }
 
-void Packet::EnsureCapacity( int cap )
+void Packet::WriteVarint( unsigned int val )
 {
-	int needed = cap - _MaxLen;
-
-	if ( needed > 0 )
+	char temp[5];
+	int n = 0;
+	
+	while ( val >= 0x80 )
 	{
-		if ( needed < 64 )
-			needed = 64;
-
-		_MaxLen += needed;
-		
-		char *old = _Buff;
-		
-		_Buff = new char[_MaxLen];
-		
-		if ( old && _Len )
-		{
-			memcpy( _Buff, old, _Len );
-			delete[] old;
-		}
+		temp[n++] = (char)( val | 0x80 );
+		val >>= 7;
 	}
+	
+	temp[n++] = (char)val;
+	
+	WriteRaw( temp, n );
+}
+
+void Packet::EnsureCapacity( int cap )
+{
+	// callers that know what they're about to write reserve it all up front
+	if ( cap > _MaxLen )
+		Own( cap );
 }
 
 void Packet::PreWrite( int size )
 {
-	int needed = ( _Pos + size ) - _MaxLen;
+	int needed = _Pos + size;
 
-	if ( needed > 0 )
+	if ( needed > _MaxLen )
 	{
-		char *old = _Buff;
-
-		if ( needed < 64 )
-			needed = 64;
-
-		_MaxLen += needed;
-
-		_Buff = new char[_MaxLen];
-		memcpy( _Buff, old, _Len );
+		// grow geometrically so building a big list is linear instead of quadratic
+		int cap = _MaxLen * 2;
+		
+		if ( cap < 64 )
+			cap = 64;
+		if ( cap < needed )
+			cap = needed;
 
-		delete[] old;
+		Own( cap );
 	}
+	else if ( _Shared->IsShared() )
+	{
+		Own( _MaxLen );
+	}
+
+	if ( _Len < needed )
+		_Len = needed;
+}
 
-	if ( _Len < _Pos + size )
-		_Len = _Pos + size;
+void Packet::Own( int cap )
+{
+	if ( !_Shared->IsShared() && cap <= _MaxLen )
+		return;
+	
+	if ( cap < _MaxLen )
+		cap = _MaxLen;
+	
+	SharedBuffer *old = _Shared;
+	
+	_Shared = SharedBuffer::Alloc( cap );
+	memcpy( _Shared->Data(), _Buff, _Len );
+	
+	_Buff = _Shared->Data();
+	_MaxLen = (int)_Shared->Size();
+	
+	old->Release();
 }
 
 ostream &operator << ( ostream &out, const Packet &p )
@@ -210,91 +283,93 @@ ostream &operator << ( ostream &out, const Packet &p )
 
 
 
-PacketReader::PacketReader( const char *buff ) : _Buff( NULL ), _Len( 0 ), _Pos( PAYLOAD_BEGIN )
+PacketReader::PacketReader( const char *buff ) : _Shared( NULL ), _Buff( NULL ), _Len( 0 ), _Pos( PAYLOAD_BEGIN )
 {
 	if ( buff )
 	{
 		_Len = ntohl( *((unsigned int *)&buff[1]) );
 		
-		_Buff = new char[_Len];
+		_Shared = SharedBuffer::Alloc( _Len );
+		_Buff = _Shared->Data();
 			
 		memcpy( _Buff, buff, _Len );
 	}
 }
 
-PacketReader::PacketReader( char *buff, int len ) : _Buff( buff ), _Len( len ), _Pos( PAYLOAD_BEGIN )
+PacketReader::PacketReader( char *buff, int len ) : _Shared( SharedBuffer::Adopt( buff, len ) ), _Buff( buff ), _Len( len ), _Pos( PAYLOAD_BEGIN )
 {
 }
 
-PacketReader::PacketReader( const PacketReader &cpy ) : _Buff( NULL ), _Len( cpy._Len ), _Pos( cpy._Pos )
+PacketReader::PacketReader( SharedBuffer *buff, int offset ) : _Shared( buff->Ref() ), _Buff( buff->Data() + offset ), _Len( 0 ), _Pos( PAYLOAD_BEGIN )
 {
-	_Buff = new char[_Len];
+	_Len = ntohl( *((unsigned int *)&_Buff[1]) );
+}
 
-	memcpy( _Buff, cpy._Buff, _Len );
+PacketReader::PacketReader( const PacketReader &cpy ) : _Shared( NULL ), _Buff( NULL ), _Len( 0 ), _Pos( PAYLOAD_BEGIN )
+{
+	Attach( cpy );
 }
 
 PacketReader::~ PacketReader()
 {
-	delete[] _Buff;
+	if ( _Shared )
+		_Shared->Release();
 }
 
 const PacketReader &PacketReader:: operator = ( const PacketReader &copy )
 {
 	if ( &copy != this )
 	{
-		delete[] _Buff;
+		if ( _Shared )
+			_Shared->Release();
 		
-		_Len = copy._Len;
-		_Pos = copy._Pos;
-		if ( copy._Buff && _Len > 0 )
-		{
-			_Buff = new char[_Len];
-			memcpy( _Buff, copy._Buff, _Len );
-		}
-		else
-		{
-			_Buff = NULL;
-		}
+		Attach( copy );
 	}
 	
 	return *this;
 }
 
+void PacketReader::Attach( const PacketReader &other )
+{
+	// nobody writes through a reader, so copies just share the frame
+	_Shared = other._Shared ? other._Shared->Ref() : NULL;
+	_Buff = other._Buff;
+	_Len = other._Len;
+	_Pos = other._Pos;
+}
+
 bool PacketReader::IsValid() const
 {
-	return _Buff != NULL && _Len >= PAYLOAD_BEGIN && _Len <= 0x4000;
+	return _Buff != NULL && _Len >= PAYLOAD_BEGIN && _Len <= PACKET_MAX_LENGTH;
 }
 
 Packet PacketReader::MakePacket()
 {
-	Packet p( Command(), RequestID(), Length() );
+	if ( _Shared )
+		return Packet( _Shared, _Buff, _Len ); // shares our frame until someone writes to it
 	
-	if ( Length() > PAYLOAD_BEGIN )
-		p.WriteRaw( &_Buff[PAYLOAD_BEGIN], Length() - PAYLOAD_BEGIN );
-	
-	return p;
+	return Packet( NOTHING );
 }
 
 int PacketReader::ReadASCII( char *buff, int max )
 {
-	int p;
+	int left = _Len - _Pos;
 	
-	for( p = 0; !AtEnd(); _Pos++, p++ )
-	{
-		buff[p] = _Buff[_Pos];
-		if ( _Buff[_Pos] == 0 )
-		{
-			_Pos++;
-			break;
-		}
-		else if ( p+1 >= max )
-		{
-			p = max - 1;
-			break;
-		}
-	}
+	if ( left < 0 )
+		left = 0;
+	
+	// let libc find the terminator, its memchr is vectorized
+	const char *start = &_Buff[_Pos];
+	const char *end = (const char *)memchr( start, 0, left );
 	
+	int len = end ? end - start : left;
+	int p = len < max ? len : max - 1;
+	
+	memcpy( buff, start, p );
 	buff[p] = 0;
+	
+	// skip the whole string even if it didn't fit, so the next field still lines up
+	_Pos += end ? len + 1 : len;
 
 	return p;
 }
@@ -318,6 +393,19 @@ NetAddress PacketReader::ReadAddress()
 	return NetAddress( ip, port );
 }
 
+int PacketReader::ReadAddresses( AddressList &list, int count )
+{
+	int avail = ( _Len - _Pos ) / 6;
+	
+	if ( count > avail )
+		count = avail;
+	
+	for ( int i = 0; i < count; i++, _Pos += 6 )
+		list.push_back( NetAddress( (in_addr_t)ntohl( *((unsigned int *)&_Buff[_Pos]) ), ntohs( *((unsigned short *)&_Buff[_Pos+4]) ) ) );
+	
+	return count;
+}
+
 int PacketReader::ReadInt()
 {
 	if ( _Pos + 4 > _Len )
@@ -342,6 +430,20 @@ unsigned int PacketReader::ReadUnsignedInt()
 	return val;
 }
 
+bool PacketReader::ReadUnsignedInts( unsigned int *vals, int count )
+{
+	if ( count < 0 || _Pos + count * 4 > _Len )
+		return false;
+	
+	const unsigned int *in = (const unsigned int *)&_Buff[_Pos];
+	for ( int i = 0; i < count; i++ )
+		vals[i] = ntohl( in[i] );
+	
+	_Pos += count * 4;
+	
+	return true;
+}
+
 short PacketReader::ReadShort()
 {
 	if ( _Pos + 2 > _Len )
@@ -362,6 +464,23 @@ char PacketReader::ReadByte()
 	return _Buff[_Pos++];
 }
 
+unsigned int PacketReader::ReadVarint()
+{
+	unsigned int val = 0;
+	
+	for ( int shift = 0; _Pos < _Len && shift < 35; shift += 7 )
+	{
+		unsigned char b = (unsigned char)_Buff[_Pos++];
+		
+		val |= (unsigned int)( b & 0x7F ) << shift;
+		
+		if ( !( b & 0x80 ) )
+			break;
+	}
+	
+	return val;
+}
+
 ostream &operator << ( ostream &out, const PacketReader &p )
 {
 	char buffer[80];
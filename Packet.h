@@ -20,6 +20,16 @@
 #ifndef __PACKET_H_
 #define __PACKET_H_
 
+#include <list>
+
+#include "Buffer.h"
+
+#define PACKET_MAX_LENGTH 0x100100 // largest frame we accept, a 1 MB DATA_BLOCK plus headers
+#define PACKET_LEGACY_LENGTH 0x10000 // what we assume a peer accepts until its IN_PORT says otherwise
+
+#define PROTOCOL_VERSION 5 // advertised in IN_PORT, peers that don't send one are 1. 3 takes the tree as ALPHA_CHUNKs, 4 holds metadata leases, 5 pages LIST_RESP
+#define PACKET_V2_MARK ((short)0x8000) // leads a v2 encoded metadata body, no v1 count or status is ever this
+
 
 enum COMMANDS
 {
@@ -52,19 +62,25 @@ enum COMMANDS
 	
 	UPDATE_DRM,		// 0x18
 	MAKE_ALPHA,
+	ALPHA_CHUNK,
+	LEASE_BREAK,
 };
 	
 class NetAddress;
 class Packet;
 class PacketReader;
 
+typedef std::list<NetAddress> AddressList; // same as Buddy.h, we can get included before it
+
 class Packet
 {
 public:
 	static const int PAYLOAD_BEGIN = 1+4+4;
 	
+	static unsigned int NewRequestID(); // counts up from 1 and never hands out 0, so ids only repeat after 4 billion packets
+	
 	explicit Packet( int cmd, int reqID = 0, int length = 0 );
-	Packet( const Packet &cpy );
+	Packet( const Packet &cpy ); // shares the buffer, whoever writes first gets their own copy
 	virtual ~Packet();
 	
 	const Packet &operator = ( const Packet &copy );
@@ -73,6 +89,7 @@ public:
 	int Length() const { return _Len; }
 	int Capacity() const { return _MaxLen; }
 	const char *Buffer();
+	SharedBuffer *Share( int &offset ); // like Buffer(), but hands out a reference to the buffer, the frame starts at offset
 
 	PacketReader MakeReader();
 	
@@ -82,10 +99,13 @@ public:
 	void WriteRaw( const void *ptr, int size );
 	void WriteASCII( const char *ascii );
 	void WriteAddress( const NetAddress &addr );
+	void WriteAddresses( const AddressList &list ); // just the addresses, writing the count is up to the caller
 	void WriteInt( int );
 	void WriteUnsignedInt( unsigned int );
+	void WriteUnsignedInts( const unsigned int *vals, int count );
 	void WriteShort( short );
 	void WriteByte( char );
+	void WriteVarint( unsigned int ); // 7 bits a byte, low bits first, 1 to 5 bytes
 	void WriteBool( bool val ) { WriteByte( val ? 1 : 0 ); }
 
 	void EnsureCapacity( int cap );
@@ -93,9 +113,17 @@ public:
 	friend ostream &operator << ( ostream &out, const Packet &p );
 	
 private:
+	friend class PacketReader;
+	
+	explicit Packet( SharedBuffer *buff, char *frame, int len ); // wraps a finished frame without copying it
+	
 	void PreWrite( int size );
+	void Own( int cap ); // make sure _Buff is ours alone and holds at least cap bytes
 	
-	char *_Buff;
+	static unsigned int _LastID;
+	
+	SharedBuffer *_Shared;
+	char *_Buff; // points into _Shared
 	int _MaxLen, _Len, _Pos;
 };
 
@@ -104,8 +132,9 @@ class PacketReader
 public:
 	static const int PAYLOAD_BEGIN = Packet::PAYLOAD_BEGIN;
 	
-	explicit PacketReader( const char *buff );
-	explicit PacketReader( char *buff, int len );
+	explicit PacketReader( const char *buff ); // copies the frame
+	explicit PacketReader( char *buff, int len ); // attaches to buff and will delete it
+	explicit PacketReader( SharedBuffer *buff, int offset ); // borrows the frame at offset, copies of the reader share it too
 	PacketReader( const PacketReader &cpy );
 	virtual ~PacketReader();
 	
@@ -131,17 +160,23 @@ public:
 	bool ReadRaw( void *ptr, int size );
 	
 	NetAddress ReadAddress();
+	int ReadAddresses( AddressList &list, int count ); // appends up to count addresses, returns how many there were
 	
 	int ReadInt();
 	unsigned int ReadUnsignedInt();
+	bool ReadUnsignedInts( unsigned int *vals, int count ); // all or nothing
 	short ReadShort();
 	char ReadByte();
+	unsigned int ReadVarint();
 	bool ReadBool() { return ReadByte() != 0; }
 	
 	friend ostream &operator << ( ostream &out, const PacketReader &p );
 	
 private:
-	char *_Buff;
+	void Attach( const PacketReader &other );
+	
+	SharedBuffer *_Shared;
+	char *_Buff; // points into _Shared
 	int _Len, _Pos;
 };
 
@@ -21,17 +21,17 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sched.h>
+#include <errno.h>
 
 #include "Buddy.h"
 #include "Packet.h"
 #include "Socket.h"
 #include "Request.h"
+#include "Stats.h"
 
-Mutex NetworkRequest::_GlobalMutex;
-NetworkRequest::NetworkRequestMap NetworkRequest::_ReqMap;
-vector<NetworkRequest*> NetworkRequest::_Delete;
+NetworkRequest::Shard NetworkRequest::_Shards[REQUEST_SHARDS];
 
-NetworkRequest::NetworkRequest() : _Cmd( -1 ), _ID( 0 )
+NetworkRequest::NetworkRequest() : _Cmd( -1 ), _ID( 0 ), _Refs( 1 ), _Expired( false ), _Answered( false ), _Callback( NULL ), _Arg( NULL )
 {
 	pthread_cond_init( &_Cond, NULL );
 	pthread_mutex_init( &_Mutex, NULL );
@@ -39,155 +39,462 @@ NetworkRequest::NetworkRequest() : _Cmd( -1 ), _ID( 0 )
 
 NetworkRequest::~NetworkRequest()
 {
+	Cancel();
+	
 	pthread_cond_destroy( &_Cond );
 	pthread_mutex_destroy( &_Mutex );
 }
 
-void NetworkRequest::Slice()
+NetworkRequest *NetworkRequest::Find( unsigned int reqID )
 {
-	vector<NetworkRequest *> bcast;
+	Shard &shard = GetShard( reqID );
+	NetworkRequest *req = NULL;
 	
-	_GlobalMutex.Lock();
-	timeval now;
+	shard.lock.Lock();
+	NetworkRequestMap::iterator iter = shard.reqs.find( reqID );
+	if ( iter != shard.reqs.end() )
+	{
+		req = iter->second;
+		req->Ref();
+	}
+	shard.lock.Unlock();
 	
-	while ( _Delete.size() > 0 )
+	return req;
+}
+
+void NetworkRequest::Slice()
+{
+	TimerWheel::Advance();
+}
+
+void NetworkRequest::OnTimer()
+{
+	Shard &shard = GetShard( _ID );
+	bool listed = false;
+	
+	shard.lock.Lock();
+	NetworkRequestMap::iterator iter = shard.reqs.find( _ID );
+	if ( iter != shard.reqs.end() && iter->second == this )
 	{
-		delete _Delete[0];
-		_Delete.erase( _Delete.begin() );
+		shard.reqs.erase( iter );
+		listed = true;
 	}
+	shard.lock.Unlock();
 	
-	for( NetworkRequestMap::iterator iter = _ReqMap.begin(); iter != _ReqMap.end(); iter++ )
+	if ( listed )
 	{
-		NetworkRequest *req = iter->second;
+		pthread_mutex_lock( &_Mutex );
+		bool answered = _Answered;
+		pthread_mutex_unlock( &_Mutex );
 		
-		gettimeofday( &now, NULL );
+		if ( !answered )
+			Stats::Timeout( _Cmd );
 		
-		if ( now.tv_sec > req->_EndTime.tv_sec || ( now.tv_sec == req->_EndTime.tv_sec && now.tv_usec >= req->_EndTime.tv_usec ) )
-		{
-			_ReqMap.erase( iter );
-			_Delete.push_back( req );
-			
-			bcast.push_back( req );
-		}
+		Expire();
+		Release(); // the table's reference, waiters still hold their own
 	}
-	_GlobalMutex.Unlock();
+}
+
+void NetworkRequest::Expire()
+{
+	pthread_mutex_lock( &_Mutex );
+	_Expired = true;
+	Callback callback = _Callback;
+	if ( callback )
+		_Callers.push_back( pthread_self() );
+	Wake();
+	pthread_mutex_unlock( &_Mutex );
 	
-	for(unsigned int i=0;i<bcast.size();i++)
+	if ( callback )
 	{
-		NetworkRequest *req = bcast[i];
-		
-		pthread_mutex_lock( &req->_Mutex );
-		pthread_cond_broadcast( &req->_Cond );
-		pthread_mutex_unlock( &req->_Mutex );
-			
-		sched_yield();
+		PacketReader none( NULL );
+		callback( none, _Arg );
+		Returned();
 	}
 }
 
-void NetworkRequest::HandleReceive( Socket *sock, PacketReader &reader )
+void NetworkRequest::Returned()
 {
-	NetworkRequest *req = NULL;
+	pthread_mutex_lock( &_Mutex );
 	
-	_GlobalMutex.Lock();
-	NetworkRequestMap::iterator iter = _ReqMap.find( reader.RequestID() );
-	if ( iter == _ReqMap.end() )
+	for ( unsigned int i = 0; i < _Callers.size(); i++ )
 	{
-		_GlobalMutex.Unlock();
-		return;
+		if ( pthread_equal( _Callers[i], pthread_self() ) )
+		{
+			_Callers.erase( _Callers.begin() + i );
+			break;
+		}
 	}
-	_GlobalMutex.Unlock();
+	
+	pthread_cond_broadcast( &_Cond ); // Unregister() may be waiting on us
+	pthread_mutex_unlock( &_Mutex );
+}
 
-	req = iter->second;
+void NetworkRequest::Wake()
+{
+	pthread_cond_broadcast( &_Cond );
+	
+	for ( unsigned int i = 0; i < _Waiters.size(); i++ )
+	{
+		Waiter *w = _Waiters[i];
 		
+		pthread_mutex_lock( &w->mutex );
+		w->wakeups++;
+		pthread_cond_broadcast( &w->cond );
+		pthread_mutex_unlock( &w->mutex );
+	}
+}
+
+bool NetworkRequest::Finished( const timeval &now ) const
+{
+	return _Expired || now.tv_sec > _EndTime.tv_sec || ( now.tv_sec == _EndTime.tv_sec && now.tv_usec >= _EndTime.tv_usec );
+}
+
+bool NetworkRequest::HandleReceive( Socket *sock, PacketReader &reader )
+{
+	NetworkRequest *req = Find( reader.RequestID() );
+	
+	if ( req == NULL )
+		return false;
+	
+	Callback callback = NULL;
+	bool first = false, taken = false;
+	timeval sent;
+	
 	pthread_mutex_lock( &req->_Mutex );
 		
-	if ( req->_Cmd == reader.Command() )
+	if ( req->_Cmd == reader.Command() && !req->_Expired )
 	{
-		req->_Resp.push( reader );
-		pthread_cond_broadcast( &req->_Cond );
+		taken = true;
+		first = !req->_Answered;
+		sent = req->_Sent;
+		req->_Answered = true;
+		callback = req->_Callback;
+		
+		if ( callback == NULL )
+		{
+			req->_Resp.push( reader );
+			req->Wake();
+		}
+		else
+		{
+			req->_Callers.push_back( pthread_self() ); // before we let go, so Unregister() knows to wait for us
+		}
 	}
 		
 	pthread_mutex_unlock( &req->_Mutex );
 	
+	if ( first )
+		Stats::Request( reader.Command(), sent );
+	
+	if ( callback )
+	{
+		callback( reader, req->_Arg );
+		req->Returned();
+	}
+	
+	req->Release();
+	
 	sched_yield();
+	
+	return taken;
+}
+
+void NetworkRequest::Register( int command, unsigned int reqID, int timeout )
+{
+	Add( command, reqID, NULL, NULL, timeout );
+}
+
+void NetworkRequest::Register( int command, unsigned int reqID, Callback callback, void *arg, int timeout )
+{
+	Add( command, reqID, callback, arg, timeout );
 }
 
-void NetworkRequest::Register( int command, unsigned short reqID, int timeout )
+void NetworkRequest::Add( int command, unsigned int reqID, Callback callback, void *arg, int timeout )
 {
+	Shard &shard = GetShard( reqID );
 	NetworkRequest *req;
 	
-	_GlobalMutex.Lock();
-	NetworkRequestMap::iterator iter = _ReqMap.find( reqID );
-	if ( iter != _ReqMap.end() )
+	shard.lock.Lock();
+	NetworkRequestMap::iterator iter = shard.reqs.find( reqID );
+	if ( iter != shard.reqs.end() )
+	{
 		req = iter->second;
+	}
 	else
+	{
 		req = new NetworkRequest();
+		shard.reqs.insert( NetworkRequestMap::value_type( reqID, req ) );
+	}
 	
-	gettimeofday( &req->_EndTime, NULL );
+	pthread_mutex_lock( &req->_Mutex );
+	gettimeofday( &req->_Sent, NULL );
+	req->_EndTime = req->_Sent;
 	req->_EndTime.tv_sec += timeout;
 	
+	req->_Answered = false;
 	req->_Cmd = command;
 	req->_ID = reqID;
+	req->_Callback = callback;
+	req->_Arg = arg;
+	pthread_mutex_unlock( &req->_Mutex );
 	
-	_ReqMap.insert( NetworkRequestMap::value_type( reqID, req ) );
+	// still under the shard lock, so OnTimer() can't have it half out of the table
+	req->Schedule( timeout * 1000 );
 	
-	_GlobalMutex.Unlock();
+	shard.lock.Unlock();
 }
 
-bool NetworkRequest::WaitForResponse( unsigned short reqID )
+void NetworkRequest::Unregister( unsigned int reqID )
 {
+	Shard &shard = GetShard( reqID );
 	NetworkRequest *req = NULL;
 	
-	_GlobalMutex.Lock();
-	NetworkRequestMap::iterator iter = _ReqMap.find( reqID );
-	if ( iter != _ReqMap.end() )
+	shard.lock.Lock();
+	NetworkRequestMap::iterator iter = shard.reqs.find( reqID );
+	if ( iter != shard.reqs.end() )
+	{
 		req = iter->second;
-	_GlobalMutex.Unlock();
+		shard.reqs.erase( iter );
+	}
+	shard.lock.Unlock();
 	
 	if ( req == NULL )
-		return false;
+		return;
+	
+	req->Cancel(); // not under the shard lock, a timer that's going off right now needs it to finish
 	
 	pthread_mutex_lock( &req->_Mutex );
-	if ( req->_Resp.empty() )
+	req->_Expired = true; // no callback starts after this
+	req->Wake();
+	
+	// one already under way still has the arg, which whoever is unregistering is likely about to free.
+	// from inside the callback itself we just return
+	for (;;)
+	{
+		bool other = false;
+		
+		for ( unsigned int i = 0; i < req->_Callers.size(); i++ )
+			other = other || !pthread_equal( req->_Callers[i], pthread_self() );
+		
+		if ( !other )
+			break;
+		
 		pthread_cond_wait( &req->_Cond, &req->_Mutex );
+	}
 	
-	bool ok = !req->_Resp.empty();
 	pthread_mutex_unlock( &req->_Mutex );
 	
+	req->Release();
+}
+
+PacketReader NetworkRequest::WaitForResponse( unsigned int reqID )
+{
+	RequestFuture f( reqID ); // one future for both, the request can be gone by the time a second one looks it up
+	
+	if ( !f.Wait() )
+		return PacketReader( NULL );
+	
+	return f.Get();
+}
+
+
+
+RequestFuture::RequestFuture( unsigned int reqID ) : _Req( NetworkRequest::Find( reqID ) )
+{
+}
+
+RequestFuture::RequestFuture( const RequestFuture &cpy ) : _Req( cpy._Req )
+{
+	if ( _Req )
+		_Req->Ref();
+}
+
+RequestFuture::~RequestFuture()
+{
+	if ( _Req )
+		_Req->Release();
+}
+
+const RequestFuture &RequestFuture::operator = ( const RequestFuture &cpy )
+{
+	if ( cpy._Req )
+		cpy._Req->Ref();
+	if ( _Req )
+		_Req->Release();
+	
+	_Req = cpy._Req;
+	
+	return *this;
+}
+
+bool RequestFuture::Wait()
+{
+	if ( _Req == NULL )
+		return false;
+	
+	pthread_mutex_lock( &_Req->_Mutex );
+	
+	// the timer wakes us when the request expires, the deadline is only there in case nobody is driving the wheel
+	timespec deadline;
+	deadline.tv_sec = _Req->_EndTime.tv_sec;
+	deadline.tv_nsec = _Req->_EndTime.tv_usec * 1000;
+	
+	while ( _Req->_Resp.empty() && !_Req->_Expired )
+	{
+		if ( pthread_cond_timedwait( &_Req->_Cond, &_Req->_Mutex, &deadline ) == ETIMEDOUT )
+			break;
+	}
+	
+	bool ok = !_Req->_Resp.empty();
+	pthread_mutex_unlock( &_Req->_Mutex );
+	
 	return ok;
 }
 
-PacketReader NetworkRequest::GetResponse( unsigned short reqID )
+PacketReader RequestFuture::Get()
 {
-	_GlobalMutex.Lock();
-	NetworkRequestMap::iterator iter = _ReqMap.find( reqID );
-	if ( iter == _ReqMap.end() )
+	PacketReader resp( NULL );
+	
+	if ( _Req == NULL )
+		return resp;
+	
+	pthread_mutex_lock( &_Req->_Mutex );
+	
+	if ( !_Req->_Resp.empty() )
 	{
-		_GlobalMutex.Unlock();
-		return PacketReader( NULL );
+		resp = _Req->_Resp.front();
+		_Req->_Resp.pop();
 	}
-	_GlobalMutex.Unlock();
 	
-	// may regfault when no response or bad request id
-	NetworkRequest *req = iter->second;
+	pthread_mutex_unlock( &_Req->_Mutex );
 	
-	pthread_mutex_lock( &req->_Mutex );
+	return resp;
+}
+
+int RequestFuture::WaitAny( vector<RequestFuture> &futures )
+{
+	return Wait( futures, false );
+}
+
+bool RequestFuture::WaitAll( vector<RequestFuture> &futures )
+{
+	return Wait( futures, true ) >= 0;
+}
+
+int RequestFuture::Wait( vector<RequestFuture> &futures, bool all )
+{
+	NetworkRequest::Waiter w;
+	
+	pthread_mutex_init( &w.mutex, NULL );
+	pthread_cond_init( &w.cond, NULL );
+	w.wakeups = 0;
 	
-	if ( !req->_Resp.empty() )
+	for ( unsigned int i = 0; i < futures.size(); i++ )
 	{
-		PacketReader resp = req->_Resp.front();
-		req->_Resp.pop();
+		NetworkRequest *req = futures[i]._Req;
+		
+		if ( req )
+		{
+			pthread_mutex_lock( &req->_Mutex );
+			req->_Waiters.push_back( &w );
+			pthread_mutex_unlock( &req->_Mutex );
+		}
+	}
+	
+	int ret;
 	
-		pthread_mutex_unlock( &req->_Mutex );
+	for (;;)
+	{
+		// note how many pokes we've had before looking, so one that comes in while we look isn't lost
+		pthread_mutex_lock( &w.mutex );
+		int seen = w.wakeups;
+		pthread_mutex_unlock( &w.mutex );
 		
-		return resp;
+		timeval now, first;
+		gettimeofday( &now, NULL );
+		
+		int pending = 0, answered = -1;
+		bool missing = false;
+		
+		for ( unsigned int i = 0; i < futures.size(); i++ )
+		{
+			NetworkRequest *req = futures[i]._Req;
+			
+			if ( req == NULL )
+			{
+				missing = true;
+				continue;
+			}
+			
+			pthread_mutex_lock( &req->_Mutex );
+			
+			if ( !req->_Resp.empty() )
+			{
+				if ( answered < 0 )
+					answered = i;
+			}
+			else if ( req->Finished( now ) )
+			{
+				missing = true;
+			}
+			else
+			{
+				if ( pending == 0 || req->_EndTime.tv_sec < first.tv_sec || ( req->_EndTime.tv_sec == first.tv_sec && req->_EndTime.tv_usec < first.tv_usec ) )
+					first = req->_EndTime;
+				
+				pending++;
+			}
+			
+			pthread_mutex_unlock( &req->_Mutex );
+		}
+		
+		if ( !all && answered >= 0 )
+		{
+			ret = answered;
+			break;
+		}
+		
+		if ( pending == 0 )
+		{
+			ret = all && !missing ? 0 : -1;
+			break;
+		}
+		
+		timespec deadline;
+		deadline.tv_sec = first.tv_sec;
+		deadline.tv_nsec = first.tv_usec * 1000;
+		
+		pthread_mutex_lock( &w.mutex );
+		while ( w.wakeups == seen )
+		{
+			if ( pthread_cond_timedwait( &w.cond, &w.mutex, &deadline ) == ETIMEDOUT )
+				break;
+		}
+		pthread_mutex_unlock( &w.mutex );
 	}
-	else
+	
+	for ( unsigned int i = 0; i < futures.size(); i++ )
 	{
-		pthread_mutex_unlock( &req->_Mutex );
+		NetworkRequest *req = futures[i]._Req;
 		
-		return PacketReader( NULL );
+		if ( req )
+		{
+			pthread_mutex_lock( &req->_Mutex );
+			for ( unsigned int j = 0; j < req->_Waiters.size(); j++ )
+			{
+				if ( req->_Waiters[j] == &w )
+				{
+					req->_Waiters.erase( req->_Waiters.begin() + j );
+					break;
+				}
+			}
+			pthread_mutex_unlock( &req->_Mutex );
+		}
 	}
+	
+	pthread_cond_destroy( &w.cond );
+	pthread_mutex_destroy( &w.mutex );
+	
+	return ret;
 }
-
-
@@ -26,6 +26,7 @@
 #include <vector>
 #include <map>
 #include <queue>
+#include <tr1/unordered_map>
 
 using std::vector;
 using std::map;
@@ -33,34 +34,107 @@ using std::map;
 #include "Mutex.h"
 #include "Packet.h"
 #include "Socket.h"
+#include "Timer.h"
 
-class NetworkRequest
+#define REQUEST_SHARDS 16 // ids count up, so id % REQUEST_SHARDS spreads them out evenly
+
+class RequestFuture;
+
+class NetworkRequest : public Timer
 {
 public:
-	static void Slice();
+	typedef void (*Callback)( PacketReader &resp, void *arg ); // resp isn't valid when it's the timeout calling
+	
+	static void Slice(); // timeouts run off the timer wheel now, this just gives it a nudge
 	
-	static void HandleReceive( Socket *sock, PacketReader &reader );
+	static bool HandleReceive( Socket *sock, PacketReader &reader ); // true if it was a response somebody is waiting on
 	
-	static void Register( int command, unsigned short reqID, int timeout = 10 );
+	static void Register( int command, unsigned int reqID, int timeout = 10 );
+	// instead of queueing up, responses are handed to callback on the I/O thread, and it gets called once more when the request times out
+	static void Register( int command, unsigned int reqID, Callback callback, void *arg, int timeout = 10 );
+	static void Unregister( unsigned int reqID ); // done with it before it times out, waiters wake up as if it had. once it returns no callback is running with the arg, unless it's the one calling
 	
-	static bool WaitForResponse( unsigned short reqID );
-	static PacketReader GetResponse( unsigned short reqID );
+	static PacketReader WaitForResponse( unsigned int reqID ); // not valid if the request times out with nothing to show for it
+	
+protected:
+	virtual void OnTimer();
 	
 private:
-	typedef map<unsigned short, NetworkRequest *> NetworkRequestMap;
+	friend class RequestFuture;
+	
+	typedef std::tr1::unordered_map<unsigned int, NetworkRequest *> NetworkRequestMap;
+	
+	struct Shard
+	{
+		Mutex lock;
+		NetworkRequestMap reqs;
+	};
+	
+	// someone waiting on several requests at once, each of them pokes it when it has news
+	struct Waiter
+	{
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		int wakeups;
+	};
+	
+	static Shard &GetShard( unsigned int reqID ) { return _Shards[ reqID % REQUEST_SHARDS ]; }
+	static NetworkRequest *Find( unsigned int reqID ); // comes back with a reference, Release() it
+	static void Add( int command, unsigned int reqID, Callback callback, void *arg, int timeout );
+	
 	NetworkRequest();
 	~NetworkRequest();
 	
+	void Ref() { __sync_fetch_and_add( &_Refs, 1 ); }
+	void Release() { if ( __sync_sub_and_fetch( &_Refs, 1 ) == 0 ) delete this; }
+	
+	void Expire(); // mark it done and tell anyone waiting, then the callback if there is one
+	void Wake(); // must hold _Mutex
+	void Returned(); // the callback this thread was running is done
+	bool Finished( const timeval &now ) const; // timed out or gone, must hold _Mutex
+	
 	int _Cmd;
-	unsigned short _ID;
+	unsigned int _ID;
+	int _Refs; // one for the table, one for each waiter
+	bool _Expired;
+	bool _Answered; // the first response has been timed
 	queue<PacketReader> _Resp;
+	Callback _Callback;
+	void *_Arg;
+	vector<pthread_t> _Callers; // threads running the callback right now
+	vector<Waiter *> _Waiters;
 	pthread_mutex_t _Mutex;
 	pthread_cond_t _Cond;
-	timeval _EndTime;
+	timeval _Sent, _EndTime;
 
-	static vector<NetworkRequest *> _Delete;
-	static NetworkRequestMap _ReqMap;
-	static Mutex _GlobalMutex;
+	static Shard _Shards[REQUEST_SHARDS];
+};
+
+// a handle on a request that's been Register()ed, so it can be waited on by itself or along with others.
+// this is how to have several requests out at once: fan them out, then WaitAny() or WaitAll().
+class RequestFuture
+{
+public:
+	RequestFuture() : _Req( NULL ) {}
+	explicit RequestFuture( unsigned int reqID );
+	RequestFuture( const RequestFuture &cpy );
+	~RequestFuture();
+	
+	const RequestFuture &operator = ( const RequestFuture &cpy );
+	
+	bool IsValid() const { return _Req != NULL; }
+	unsigned int RequestID() const { return _Req ? _Req->_ID : 0; }
+	
+	bool Wait(); // false if it timed out without a response
+	PacketReader Get(); // next response, not valid if there isn't one
+	
+	static int WaitAny( vector<RequestFuture> &futures ); // index of one that has a response, -1 once none of them ever will
+	static bool WaitAll( vector<RequestFuture> &futures ); // false if any of them timed out without a response
+	
+private:
+	static int Wait( vector<RequestFuture> &futures, bool all );
+	
+	NetworkRequest *_Req;
 };
 
 #endif
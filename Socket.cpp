@@ -18,118 +18,379 @@
 */
 
 #include <map>
+#include <vector>
 #include <iostream>
 using namespace std;
 
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <netdb.h>
 
 #include "Request.h"
 #include "Buddy.h"
+#include "Listener.h"
 #include "Mutex.h"
 #include "Socket.h"
 #include "Packet.h"
+#include "Stats.h"
+#include "Log.h"
 
-Socket::SocketMap Socket::_Map;
+vector<SocketShard *> Socket::_Shards;
+Socket::ListenerMap Socket::_Listeners;
 Mutex Socket::_GlobalMutex;
+Mutex Socket::_PeerMutex;
 NetAddress Socket::_LocalAddr = NetAddress::None();
+bool Socket::_Threaded = false;
+unsigned int Socket::_NextShard = 0;
 
 LoopbackSocket *LoopbackSocket::_Inst = NULL;
 
-void Socket::Slice( int u_timeout )
+SocketShard *Socket::GetShard( int i )
+{
+	_GlobalMutex.Lock();
+	
+	if ( _Shards.empty() )
+		_Shards.push_back( new SocketShard() );
+	
+	SocketShard *shard = _Shards[ i >= 0 && i < (int)_Shards.size() ? i : 0 ];
+	
+	_GlobalMutex.Unlock();
+	
+	return shard;
+}
+
+int Socket::NextShard()
+{
+	_GlobalMutex.Lock();
+	
+	int shard = _Shards.size() > 1 ? _NextShard++ % _Shards.size() : 0;
+	
+	_GlobalMutex.Unlock();
+	
+	return shard;
+}
+
+void Socket::StartIOThreads( int count )
+{
+	if ( count < 1 || _Threaded )
+		return;
+	
+	GetShard( 0 ); // make sure the main loop's shard exists, it keeps whatever it already owns
+	
+	_GlobalMutex.Lock();
+	
+	while ( (int)_Shards.size() < count )
+		_Shards.push_back( new SocketShard() );
+	
+	for ( unsigned int i = 0; i < _Shards.size(); i++ )
+		_Shards[i]->StartThread();
+	
+	_Threaded = true;
+	
+	_GlobalMutex.Unlock();
+}
+
+Socket *Socket::FindPeer( const NetAddress &addr )
 {
-	fd_set read, write, except;
-	timeval timeout;
+	Socket *sock = NULL;
+	
+	_PeerMutex.Lock();
+	PeerMap::iterator iter = Peers.find( addr );
+	if ( iter != Peers.end() )
+		sock = iter->second;
+	_PeerMutex.Unlock();
+	
+	return sock;
+}
 
-	timeout.tv_sec = 0;
-	timeout.tv_usec = u_timeout;
+void Socket::SetPeer( const NetAddress &addr, Socket *sock )
+{
+	_PeerMutex.Lock();
+	Peers[addr] = sock;
+	_PeerMutex.Unlock();
+}
 
-	FD_ZERO( &read );
-	FD_ZERO( &write );
-	FD_ZERO( &except );
+void Socket::DropPeer( const NetAddress &addr )
+{
+	_PeerMutex.Lock();
+	Peers.erase( addr );
+	_PeerMutex.Unlock();
+}
 
-	int maxFD = 0;
-	SocketMap::iterator iter;
+int Socket::PeerCount()
+{
+	_PeerMutex.Lock();
+	int count = Peers.size();
+	_PeerMutex.Unlock();
+	
+	return count;
+}
 
+vector<Peer> Socket::PeerList()
+{
+	_PeerMutex.Lock();
+	vector<Peer> list( Peers.begin(), Peers.end() );
+	_PeerMutex.Unlock();
+	
+	return list;
+}
+
+void Socket::AddListener( Listener *listener )
+{
+	epoll_event ev;
+	
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = listener->FD();
+	
+	SocketShard *shard = GetShard( 0 ); // listeners live on the first shard and hand new sockets out from there
+	
 	_GlobalMutex.Lock();
 	
-	for ( iter = _Map.begin() ; iter != _Map.end(); iter++ )
-	{
-		int fd = iter->first;
-		FD_SET( fd, &read );
-		FD_SET( fd, &except );
-		
-		if ( iter->second->_SBPos < iter->second->_SBEnd || iter->second->_Connecting )
-			FD_SET( fd, &write );
+	_Listeners.insert( ListenerMap::value_type( listener->FD(), listener ) );
+	epoll_ctl( shard->PollFD(), EPOLL_CTL_ADD, listener->FD(), &ev );
+	
+	_GlobalMutex.Unlock();
+}
 
-		if ( fd > maxFD )
-			maxFD = fd;
+void Socket::RemoveListener( Listener *listener )
+{
+	SocketShard *shard = GetShard( 0 );
+	
+	_GlobalMutex.Lock();
+	
+	ListenerMap::iterator iter = _Listeners.find( listener->FD() );
+	if ( iter != _Listeners.end() )
+	{
+		epoll_ctl( shard->PollFD(), EPOLL_CTL_DEL, iter->first, NULL );
+		_Listeners.erase( iter );
 	}
-
+	
 	_GlobalMutex.Unlock();
+}
+
+Listener *Socket::FindListener( int fd )
+{
+	Listener *listener = NULL;
 	
-	if ( !maxFD )
-		return;
+	_GlobalMutex.Lock();
+	
+	ListenerMap::iterator iter = _Listeners.find( fd );
+	if ( iter != _Listeners.end() )
+		listener = iter->second;
+	
+	_GlobalMutex.Unlock();
 	
+	return listener;
+}
+
+void Socket::Slice( int u_timeout )
+{
 	if ( _LocalAddr == NetAddress::None() )
 	{
+		int fd = 0;
+		
+		_GlobalMutex.Lock();
+		vector<SocketShard *> shards = _Shards;
+		_GlobalMutex.Unlock();
+		
+		for ( unsigned int i = 0; i < shards.size() && !fd; i++ )
+			fd = shards[i]->AnyFD();
+		
 		sockaddr_in sai;
 		socklen_t len = sizeof(sockaddr_in);
-		if ( getsockname( maxFD, (sockaddr*)&sai, &len ) == 0 )
+		if ( fd && getsockname( fd, (sockaddr*)&sai, &len ) == 0 )
 		{
 			_LocalAddr = NetAddress( sai.sin_addr.s_addr, LocalPort );
 			
 			Clique::ChangeAddr( NetAddress::None(), _LocalAddr );
 		}
 	}
+	
+	if ( _Threaded )
+		usleep( u_timeout ); // the I/O threads do the real work, just keep the caller's pace
+	else
+		GetShard( 0 )->Slice( u_timeout );
+}
 
-	int res = select( maxFD + 1, &read, &write, &except, &timeout );
+void Socket::Pin( int shard )
+{
+	if ( !_Socket )
+		_Shard = shard;
+}
 
-	if ( res < 0 )
-	{
-		cout << "Socket::Slice() select error " << errno << ": " << strerror( errno ) << endl;
-		return ;
-	}
+void Socket::Watch( bool write )
+{
+	epoll_event ev;
+	
+	if ( !_Socket )
+		return;
+	
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if ( write )
+		ev.events |= EPOLLOUT;
+	ev.data.fd = _Socket;
+	
+	int poll = GetShard( _Shard )->PollFD();
+	
+	// MOD re-evaluates readiness, so re-arming an already writable socket still generates an edge
+	if ( epoll_ctl( poll, EPOLL_CTL_MOD, _Socket, &ev ) && errno == ENOENT )
+		epoll_ctl( poll, EPOLL_CTL_ADD, _Socket, &ev );
+	
+	_WantWrite = write;
+}
 
-	if ( res == 0 )
-		return ;
 
-	_GlobalMutex.Lock();
+
+SocketShard::SocketShard() : _Poll( epoll_create( SOCKET_MAX_EVENTS ) ), _LastSec( 0 ), _Running( false )
+{
+	if ( _Poll < 0 )
+		LOG( LOG_ERROR, "SocketShard() epoll_create error " << errno << ": " << strerror( errno ) );
+}
+
+SocketShard::~SocketShard()
+{
+	if ( _Poll >= 0 )
+		close( _Poll );
+}
+
+int SocketShard::ThreadMain()
+{
+	_Running = true;
+	
+	while ( _Running )
+		Slice( SOCKET_SHARD_TIMEOUT );
+	
+	return 0;
+}
+
+void SocketShard::Add( Socket *sock )
+{
+	Lock();
+	_Sockets[ sock->FD() ] = sock;
+	Unlock();
+}
+
+void SocketShard::Remove( Socket *sock )
+{
+	Lock();
+	
+	epoll_ctl( _Poll, EPOLL_CTL_DEL, sock->FD(), NULL );
+	
+	Socket::SocketMap::iterator iter = _Sockets.find( sock->FD() );
+	if ( iter != _Sockets.end() && iter->second == sock )
+		_Sockets.erase( iter );
+	
+	Unlock();
+}
+
+Socket *SocketShard::Find( int fd )
+{
+	Lock();
+	
+	Socket::SocketMap::iterator iter = _Sockets.find( fd );
+	Socket *sock = iter != _Sockets.end() ? iter->second : NULL;
+	
+	Unlock();
+	
+	return sock;
+}
+
+int SocketShard::AnyFD()
+{
+	Lock();
+	int fd = _Sockets.empty() ? 0 : _Sockets.rbegin()->first;
+	Unlock();
+	
+	return fd;
+}
+
+void SocketShard::Throttle( int fd )
+{
+	Lock();
+	_Throttled.push_back( fd );
+	Unlock();
+}
+
+void SocketShard::Slice( int u_timeout )
+{
+	epoll_event events[SOCKET_MAX_EVENTS];
 	
-	for ( iter = _Map.begin(); res > 0 && iter != _Map.end(); iter++ )
+	if ( _Poll < 0 )
+		return;
+	
+	// sockets that stopped sending because of the bandwidth cap won't get another edge on their own
+	if ( _LastSec != time(NULL) )
 	{
-		_GlobalMutex.Unlock();
+		vector<int> throttled;
 		
-		Socket *sock = iter->second;
-		int fd = iter->first;
-		
-		bool remove = false;
+		Lock();
+		throttled.swap( _Throttled );
+		Unlock();
 		
-		if ( FD_ISSET( fd, &except ) )
+		for ( unsigned int i = 0; i < throttled.size(); i++ )
 		{
-			res--;
-			
-			remove = true;
+			Socket *sock = Find( throttled[i] );
+			if ( sock )
+			{
+				sock->Lock();
+				sock->Watch( true );
+				sock->Unlock();
+			}
 		}
+		
+		_LastSec = time(NULL);
+	}
 
-		if ( FD_ISSET( fd, &read ) )
-		{
-			res--;
-			
-			if ( !remove )
-				remove = !sock->DoRecv();
-		}
+	// the first shard runs the timers too, so it doesn't sleep past the next one
+	bool timers = this == Socket::GetShard( 0 );
+	
+	if ( timers )
+		u_timeout = TimerWheel::NextTimeout( u_timeout );
+	
+	int res = epoll_wait( _Poll, events, SOCKET_MAX_EVENTS, ( u_timeout + 999 ) / 1000 );
 
-		if ( FD_ISSET( fd, &write ) )
+	if ( res < 0 )
+	{
+		if ( errno != EINTR )
+			LOG( LOG_ERROR, "SocketShard::Slice() epoll_wait error " << errno << ": " << strerror( errno ) );
+		res = 0;
+	}
+
+	for ( int i = 0; i < res; i++ )
+	{
+		int fd = events[i].data.fd;
+		unsigned int ev = events[i].events;
+		
+		// look the socket up again, an earlier event in this batch may have closed it
+		Socket *sock = Find( fd );
+		
+		if ( sock == NULL )
 		{
-			res--;
+			Listener *listener = Socket::FindListener( fd );
+			if ( listener )
+				listener->OnReadable();
 			
-			if ( !remove )
-				remove = !sock->DoSend();
+			continue;
 		}
+		
+		bool remove = false;
+		
+		// a finished connect has to be announced before anything that arrived with it is dispatched
+		if ( sock->_Connecting && ( ev & EPOLLOUT ) && !( ev & EPOLLERR ) )
+			remove = !sock->DoSend();
+		
+		if ( !remove && ( ev & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) )
+			remove = !sock->DoRecv();
+
+		if ( !remove && ( ev & EPOLLOUT ) )
+			remove = !sock->DoSend();
+		
+		if ( !remove && ( ev & ( EPOLLHUP | EPOLLERR ) ) )
+			remove = true;
 
 		if ( remove )
 		{
@@ -138,15 +399,16 @@ void Socket::Slice( int u_timeout )
 			
 			delete sock;
 		}
-
-		_GlobalMutex.Lock();
 	}
-
-	_GlobalMutex.Unlock();
+	
+	if ( timers )
+		TimerWheel::Advance();
 }
 
+
+
 Socket::Socket()
-	: _Addr( NetAddress::None() ), _SendBuff( NULL ), _RecvBuff( NULL ), _SBLen( 0 ), _RBLen( 0 ), _SBEnd( 0 ), _SBPos( 0 ), _RBPos( 0 ), _Socket( 0 ), _Connecting( false )
+	: _Addr( NetAddress::None() ), _RecvBuff( NULL ), _RBStart( 0 ), _RBEnd( 0 ), _SendHead( 0 ), _Queued( 0 ), _Socket( 0 ), _Shard( -1 ), _MaxFrame( PACKET_LEGACY_LENGTH ), _Protocol( 1 ), _Stats( NULL ), _ConnectTimer( this ), _Connecting( false ), _WantWrite( false )
 {
 	_BytesThisSec = 0;
 	_ThisSec = 0;
@@ -154,10 +416,30 @@ Socket::Socket()
 
 Socket::~Socket()
 {
+	_ConnectTimer.Cancel();
+	
 	Close();
 
-	delete[] _SendBuff;
-	delete[] _RecvBuff;
+	for ( SendQueue::iterator iter = _SendQueue.begin(); iter != _SendQueue.end(); iter++ )
+		iter->buf->Release();
+	
+	if ( _RecvBuff )
+		_RecvBuff->Release();
+}
+
+void Socket::ConnectTimer::OnTimer()
+{
+	_Sock->Lock();
+	
+	if ( _Sock->_Connecting && _Sock->_Socket )
+	{
+		LOG( LOG_WARN, "Connecting to " << _Sock->_Addr << " timed out" );
+		
+		// the reactor sees it hang up and gets rid of it like any other dead connection
+		shutdown( _Sock->_Socket, SHUT_RDWR );
+	}
+	
+	_Sock->Unlock();
 }
 
 void Socket::Attach( int handle, sockaddr_in addr )
@@ -168,18 +450,23 @@ void Socket::Attach( int handle, sockaddr_in addr )
 	
 	_Socket = handle;
 	_Addr = NetAddress( addr.sin_addr.s_addr, ntohs( addr.sin_port ) );
+	_Stats = NULL; // that's their ephemeral port, stats wait for IN_PORT to say the one they listen on
 	
-	PeerMap::iterator iter = Peers.find( _Addr );
-	if ( iter != Peers.end() )
-		Peers.erase( iter );
-	Peers.insert( Peer( _Addr, this ) );
-
-	_Map.insert( SocketMap::value_type( _Socket, this ) );
+	SetPeer( _Addr, this );
+	
+	_GlobalMutex.Unlock();
+	
+	if ( _Shard < 0 )
+		_Shard = NextShard();
+	
+	GetShard( _Shard )->Add( this );
 
 	int on = 1;
 	ioctl( _Socket, FIONBIO, &on );
 	
-	_GlobalMutex.Unlock();
+	Lock();
+	Watch( HasOutput() );
+	Unlock();
 }
 
 bool Socket::Connect( NetAddress na, bool nonblocking )
@@ -207,24 +494,44 @@ bool Socket::Connect( sockaddr_in addr, bool nonblocking )
 	}
 
 	_Addr = NetAddress( addr.sin_addr.s_addr, ntohs( addr.sin_port ) );
+	_Stats = Stats::Peer( _Addr );
 
 	_Connecting = true;
 
-	_Map.insert( SocketMap::value_type( _Socket, this ) );
+	if ( _Shard < 0 )
+		_Shard = NextShard();
 	
-	cout << "Connecting to " << _Addr << "..." << endl;
+	GetShard( _Shard )->Add( this );
+	
+	LOG( LOG_INFO, "Connecting to " << _Addr << "..." );
 
 	if ( nonblocking )
 	{
 		ioctl( _Socket, FIONBIO, &on );
+		
+		// even an immediate success is finished off by the reactor once it sees the socket writable
+		if ( connect( _Socket, (sockaddr*)&addr, sizeof(sockaddr_in) ) == -1 && errno != EINPROGRESS && errno != EAGAIN && errno != EWOULDBLOCK )
+		{
+			LOG( LOG_WARN, "Failed to connect to " << _Addr );
+			Close();
+			return false;
+		}
+		
+		// completion of the connect shows up as writability. only arm once connect() is under way,
+		// a socket that hasn't started connecting polls as hung up and the reactor would delete it
+		Lock();
+		Watch( true );
+		Unlock();
+		
+		_ConnectTimer.Schedule( SOCKET_CONNECT_TIMEOUT * 1000 );
 
-		return connect( _Socket, (sockaddr*)&addr, sizeof(sockaddr_in) ) == -1 && ( errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK );
+		return true;
 	}
 	else
 	{
 		if ( connect( _Socket, (sockaddr*)&addr, sizeof(sockaddr_in) ) )
 		{
-			cout << "Failed to connect to " << _Addr << endl;
+			LOG( LOG_WARN, "Failed to connect to " << _Addr );
 			Close();
 			return false;
 		}
@@ -232,10 +539,14 @@ bool Socket::Connect( sockaddr_in addr, bool nonblocking )
 		{
 			ioctl( _Socket, FIONBIO, &on );
 			
-			PeerMap::iterator iter = Peers.find( _Addr );
-			if ( iter != Peers.end() )
-				Peers.erase ( iter );
-			Peers.insert( Peer( _Addr, this ) );
+			// only hand a blocking connect to the reactor once it is done, otherwise Slice() would see it complete too
+			_Connecting = false;
+			
+			Lock();
+			Watch( HasOutput() );
+			Unlock();
+			
+			SetPeer( _Addr, this );
 			
 			OnConnect();
 			
@@ -248,17 +559,9 @@ void Socket::Detach()
 {
 	if ( _Socket )
 	{
-		_GlobalMutex.Lock();
-		
-		SocketMap::iterator it = _Map.find( _Socket );
-		if ( it != _Map.end() )
-			_Map.erase( it );
-
-		_GlobalMutex.Unlock();
+		GetShard( _Shard )->Remove( this );
 		
-		PeerMap::iterator iter = Peers.find( _Addr );
-		if ( iter != Peers.end() )
-			Peers.erase( iter );
+		DropPeer( _Addr );
 
 		_Socket = 0;
 	}
@@ -266,68 +569,111 @@ void Socket::Detach()
 
 void Socket::Close()
 {
-	if ( _Socket )
-		close( _Socket );
+	int fd = _Socket;
+	
+	// detach first so a recycled descriptor can't be unregistered out from under its new owner
 	Detach();
+	
+	if ( fd )
+		close( fd );
 }
 
 bool Socket::DoRecv()
 {
-	int val, toGet;
+	int val;
 	
-	if ( !_Socket )
-		return false;
-
 	do
 	{
+		if ( !_Socket )
+			return false;
+		
 		if ( !_RecvBuff )
 		{
-			char buff[5];
-			
-			val = recv( _Socket, buff, 5, MSG_PEEK );
-
-			if ( ( val > 0 && val < 5 ) || ( val == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) )
-				return true;
-			else if ( val < 5 )
-				return false;
-			
-			_RBPos = 0;
-			_RBLen = ntohl( *(unsigned int*)&buff[1] );
-			
-			if ( _RBLen <= 0 || _RBLen > 65536 )
-				return false; // invalid packet
-
-			_RecvBuff = new char[_RBLen];
+			_RecvBuff = SharedBuffer::Alloc( SOCKET_READ_SIZE );
+			_RBStart = _RBEnd = 0;
 		}
 		
-		toGet = _RBLen - _RBPos;
-		
-		val = recv( _Socket, &_RecvBuff[_RBPos], toGet, 0 );
+		val = recv( _Socket, _RecvBuff->Data() + _RBEnd, _RecvBuff->Size() - _RBEnd, 0 );
 		
 		if ( val > 0 )
 		{
-			_RBPos += val;
-
-			if ( _RBPos == _RBLen )
-			{
-				PacketReader reader( _RecvBuff );
-				if ( !OnReceive( reader ) )
-					return false;
-
-				delete[] _RecvBuff;
-				_RecvBuff = NULL;
-				_RBLen = 0;
-			}
+			_RBEnd += val;
+			
+			if ( _Stats )
+				Stats::Count( _Stats->bytesIn, val );
+			
+			if ( !ParseFrames() )
+				return false;
 		}
 		else if ( val == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) )
 		{
 			return false;
 		}
-	} while ( val == toGet );
+	} while ( val > 0 ); // edge triggered, so keep going until the kernel runs dry
 
 	return true;
 }
 
+bool Socket::ParseFrames()
+{
+	int len = 0;
+	
+	while ( _Socket && _RBEnd - _RBStart >= 5 )
+	{
+		len = ntohl( *(unsigned int*)( _RecvBuff->Data() + _RBStart + 1 ) );
+		
+		if ( len < PacketReader::PAYLOAD_BEGIN || len > PACKET_MAX_LENGTH )
+			return false; // invalid packet
+		
+		if ( _RBEnd - _RBStart < len )
+			break;
+		
+		PacketReader reader( _RecvBuff, _RBStart );
+		_RBStart += len;
+		
+		if ( _Stats )
+			Stats::Count( _Stats->packetsIn, 1 );
+		
+		if ( !OnReceive( reader ) )
+			return false;
+	}
+	
+	int pending = _RBEnd - _RBStart;
+	int need = pending >= 5 ? len : 5;
+	int size = (int)_RecvBuff->Size();
+	
+	if ( pending == 0 && ( _RecvBuff->IsShared() || size > SOCKET_READ_SIZE ) )
+	{
+		// a reader is hanging on to a frame, or we grew for a big one; start over with a fresh buffer
+		_RecvBuff->Release();
+		_RecvBuff = NULL;
+	}
+	else if ( pending == 0 )
+	{
+		_RBStart = _RBEnd = 0;
+	}
+	else if ( _RBStart + need > size )
+	{
+		if ( _RecvBuff->IsShared() || need > size )
+		{
+			SharedBuffer *buff = SharedBuffer::Alloc( max( need, SOCKET_READ_SIZE ) );
+			memcpy( buff->Data(), _RecvBuff->Data() + _RBStart, pending );
+			
+			_RecvBuff->Release();
+			_RecvBuff = buff;
+		}
+		else
+		{
+			memmove( _RecvBuff->Data(), _RecvBuff->Data() + _RBStart, pending );
+		}
+		
+		_RBStart = 0;
+		_RBEnd = pending;
+	}
+	
+	return true;
+}
+
 bool Socket::DoSend()
 {
 	Lock();
@@ -336,12 +682,13 @@ bool Socket::DoSend()
 	{
 		_Connecting = false;
 
+		Watch( HasOutput() );
+		
 		Unlock();
 		
-		PeerMap::iterator iter = Peers.find( _Addr );
-		if ( iter != Peers.end() )
-			Peers.erase( iter );
-		Peers.insert( Peer( _Addr, this ) );
+		_ConnectTimer.Cancel(); // not under our lock, OnTimer() takes it
+		
+		SetPeer( _Addr, this );
 		
 		OnConnect();
 		
@@ -351,24 +698,38 @@ bool Socket::DoSend()
 	if ( time(NULL) != _ThisSec )
 	{
 		if ( _BytesThisSec >= 256 )
-			cout << Addr() << ": Out bandwidth " << int( (double(_BytesThisSec)/1024.0) * 10 )/10.0 << " KB/s" << endl;
+			LOG( LOG_DEBUG, Addr() << ": Out bandwidth " << int( (double(_BytesThisSec)/1024.0) * 10 )/10.0 << " KB/s" );
 		
 		_BytesThisSec = 0;
 		_ThisSec = time(NULL);
 	}
 	
 	if ( _BytesThisSec < SOCKET_BW_LIMIT )
-	{		
-		int left = _SBEnd - _SBPos;
-		while ( left > 0 && _BytesThisSec < SOCKET_BW_LIMIT )
+	{
+		while ( HasOutput() && _BytesThisSec < SOCKET_BW_LIMIT )
 		{
-			int s = send( _Socket, &_SendBuff[ _SBPos ], left, 0 );
+			// gather up the front of the queue into one writev()
+			iovec iov[SOCKET_MAX_IOV];
+			int count = 0;
+			
+			for ( SendQueue::iterator iter = _SendQueue.begin(); iter != _SendQueue.end() && count < SOCKET_MAX_IOV; iter++ )
+			{
+				int skip = count == 0 ? _SendHead : 0;
+				
+				iov[count].iov_base = iter->buf->Data() + iter->offset + skip;
+				iov[count].iov_len = iter->size - skip;
+				count++;
+			}
+			
+			int s = writev( _Socket, iov, count );
 					
 			if ( s > 0 )
 			{
-				_SBPos += s;
+				Consume( s );
 				_BytesThisSec += s;
-				left -= s;
+				
+				if ( _Stats )
+					Stats::Count( _Stats->bytesOut, s );
 			}
 			else
 			{
@@ -381,75 +742,215 @@ bool Socket::DoSend()
 				break;
 			}
 		}
+	}
+	
+	bool throttled = false, drained = false;
 	
-		if ( _SBPos >= _SBEnd )
-			_SBPos = _SBEnd = 0;
+	if ( !HasOutput() )
+	{
+		if ( _WantWrite )
+		{
+			Watch( false );
+			drained = true;
+		}
+	}
+	else if ( _BytesThisSec >= SOCKET_BW_LIMIT )
+	{
+		throttled = true;
 	}
 	
 	Unlock();
 	
+	if ( throttled )
+		GetShard( _Shard )->Throttle( _Socket );
+	
+	if ( drained )
+		Clique::Drained( this ); // lets anything streaming to us queue up more
+	
 	return true;
 }
 
-void Socket::Send( Packet & p )
+bool Socket::Send( Packet & p )
 {
 	if ( _Connecting )
-		return;
+		return false;
 	
 	int len = p.Length();
 	const char *data = p.Buffer();
 
 	Lock();
 	
-	int newSize = ( _SBEnd - _SBPos ) + len;
+	if ( _Queued + len > SOCKET_SEND_LIMIT )
+	{
+		Unlock();
+		LOG( LOG_WARN, Addr() << ": Send queue full, dropping packet " << (int)data[0] );
+		return false;
+	}
+	
+	bool idle = !HasOutput();
 
-	if ( _SBLen > newSize && _SBEnd + len > _SBLen )
+	if ( len >= SOCKET_CHUNK_SIZE )
 	{
-		memmove( _SendBuff, &_SendBuff[ _SBPos ], _SBEnd - _SBPos );
-		_SBEnd -= _SBPos;
-		_SBPos = 0;
+		// big enough that holding a reference beats copying, so a broadcast shares one buffer
+		SendSegment seg;
+		seg.buf = p.Share( seg.offset );
+		seg.size = len;
+		seg.owned = false;
+		
+		_SendQueue.push_back( seg );
+		_Queued += len;
 	}
-	else if ( _SBLen < newSize )
+	else
 	{
-		char * temp = _SendBuff;
-		_SendBuff = new char[ newSize ];
-		memcpy( _SendBuff, &temp[ _SBPos ], _SBEnd - _SBPos );
-		delete[] temp;
-
-		_SBEnd -= _SBPos;
-		_SBPos = 0;
-		_SBLen = newSize;
+		Append( data, len );
 	}
+	
+	if ( idle )
+		Watch( true );
 
-	memcpy( &_SendBuff[ _SBEnd ], data, len );
-	_SBEnd += len;
+	Unlock();
+	
+	if ( _Stats )
+		Stats::Count( _Stats->packetsOut, 1 );
+	
+	return true;
+}
 
+bool Socket::Send( Packet &p, SharedBuffer *data, int offset, int size )
+{
+	if ( _Connecting )
+		return false;
+	
+	int len = p.Length();
+	const char *head = p.Buffer();
+	
+	Lock();
+	
+	if ( _Queued + len + size > SOCKET_SEND_LIMIT )
+	{
+		Unlock();
+		LOG( LOG_WARN, Addr() << ": Send queue full, dropping packet " << (int)head[0] );
+		return false;
+	}
+	
+	bool idle = !HasOutput();
+	
+	// the header goes out with the length of the whole frame, the payload follows from data
+	unsigned int total = htonl( (unsigned int)( len + size ) );
+	
+	Append( head, 1 );
+	Append( (const char*)&total, 4 );
+	Append( &head[5], len - 5 );
+	
+	if ( size > 0 )
+	{
+		SendSegment seg;
+		seg.buf = data->Ref();
+		seg.offset = offset;
+		seg.size = size;
+		seg.owned = false;
+		
+		_SendQueue.push_back( seg );
+		_Queued += size;
+	}
+	
+	if ( idle )
+		Watch( true );
+	
 	Unlock();
+	
+	if ( _Stats )
+		Stats::Count( _Stats->packetsOut, 1 );
+	
+	return true;
+}
+
+void Socket::Append( const char *data, int len )
+{
+	_Queued += len;
+	
+	// top off the last chunk if it's one of ours
+	if ( !_SendQueue.empty() )
+	{
+		SendSegment &tail = _SendQueue.back();
+		int room = tail.owned ? (int)tail.buf->Size() - ( tail.offset + tail.size ) : 0;
+		
+		if ( room > 0 )
+		{
+			int n = min( room, len );
+			memcpy( tail.buf->Data() + tail.offset + tail.size, data, n );
+			tail.size += n;
+			data += n;
+			len -= n;
+		}
+	}
+	
+	if ( len > 0 )
+	{
+		SendSegment seg;
+		seg.buf = SharedBuffer::Alloc( max( len, SOCKET_CHUNK_SIZE ) );
+		seg.offset = 0;
+		seg.size = len;
+		seg.owned = true;
+		
+		memcpy( seg.buf->Data(), data, len );
+		
+		_SendQueue.push_back( seg );
+	}
+}
+
+void Socket::Consume( int len )
+{
+	_Queued -= len;
+	
+	while ( len > 0 )
+	{
+		SendSegment &seg = _SendQueue.front();
+		int n = min( len, seg.size - _SendHead );
+		_SendHead += n;
+		len -= n;
+		
+		if ( _SendHead >= seg.size )
+		{
+			seg.buf->Release();
+			_SendQueue.pop_front();
+			_SendHead = 0;
+		}
+	}
 }
 
 void Socket::OnConnect()
 {
 	_Connecting = false;
 	
-	cout << _Addr << ": Connected." << endl;
+	LOG( LOG_INFO, _Addr << ": Connected." );
 	
 	Clique::Connected( this );
 	
 	Packet p( IN_PORT );
 	p.WriteShort( LocalPort );
+	p.WriteInt( PACKET_MAX_LENGTH );
+	p.WriteByte( PROTOCOL_VERSION );
 	Send( p );
 }
 
 void Socket::OnAccepted()
 {
-	cout << _Addr << ": Incoming connection established." << endl;
+	LOG( LOG_INFO, _Addr << ": Incoming connection established." );
 	
 	Clique::Connected( this );
+	
+	// answer with our own IN_PORT so the connecting side learns our frame limit, the port already matches theirs
+	Packet p( IN_PORT );
+	p.WriteShort( LocalPort );
+	p.WriteInt( PACKET_MAX_LENGTH );
+	p.WriteByte( PROTOCOL_VERSION );
+	Send( p );
 }
 
 bool Socket::OnReceive( PacketReader &reader )
 {
-	cout << Addr() << ": Recv " << reader << endl;
+	LOG( LOG_DEBUG, Addr() << ": Recv " << reader );
 	
 	reader.Seek( PacketReader::PAYLOAD_BEGIN );
 	
@@ -462,24 +963,44 @@ bool Socket::OnReceive( PacketReader &reader )
 			
 			if ( port != _Addr.Port() )
 			{
-				PeerMap::iterator iter = Peers.find( _Addr );
-				if ( iter != Peers.end() )
-					Peers.erase( iter );
+				DropPeer( _Addr );
 				
 				NetAddress old = _Addr;
 				_Addr = NetAddress( _Addr.IP(), port );
 				
 				Clique::ChangeAddr( old, _Addr );
-				Peers.insert( Peer( _Addr, this ) );
+				SetPeer( _Addr, this );
 			}
 			
+			if ( _Stats == NULL )
+				_Stats = Stats::Peer( _Addr );
+			
+			if ( !reader.AtEnd() ) // older peers only send the port
+			{
+				int maxFrame = reader.ReadInt();
+				
+				if ( maxFrame > PACKET_MAX_LENGTH )
+					maxFrame = PACKET_MAX_LENGTH;
+				
+				if ( maxFrame >= PACKET_LEGACY_LENGTH )
+					_MaxFrame = maxFrame;
+			}
+			
+			if ( !reader.AtEnd() )
+				_Protocol = min( (int)reader.ReadByte(), PROTOCOL_VERSION );
+			
+			Clique::Identified( this );
+			
 			break;
 		}
 		
 		default:
 		{
-			NetworkRequest::HandleReceive( this, reader );
-			Clique::HandleReceive( this, reader );
+			bool answered = NetworkRequest::HandleReceive( this, reader );
+			
+			// anything that isn't a response we were waiting on and no clique wanted just fell on the floor
+			if ( !Clique::HandleReceive( this, reader ) && !answered )
+				Stats::Miss( reader.Command() );
 	
 			break;
 		}
@@ -494,5 +1015,5 @@ void Socket::OnDisconnect()
 	
 	Clique::Disconnected( this );
 	
-	cout << Addr() << ": Disconnected! " << endl;
+	LOG( LOG_INFO, Addr() << ": Disconnected! " );
 }
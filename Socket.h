@@ -21,14 +21,31 @@
 #define __SOCKET_H_
 
 #include <map>
+#include <deque>
+#include <vector>
 #include <ostream>
 #include <netinet/in.h>
 
 #include "Buddy.h"
 #include "Mutex.h"
+#include "Thread.h"
 #include "Packet.h"
+#include "Buffer.h"
+#include "Timer.h"
 
 #define SOCKET_BW_LIMIT 1024000 // 1 mb/s 
+#define SOCKET_MAX_EVENTS 64 // epoll events handled per Slice()
+#define SOCKET_SHARD_TIMEOUT 50000 // usecs an I/O thread blocks in epoll_wait
+#define SOCKET_READ_SIZE 65536 // per socket read buffer, frames are parsed out of it in place
+#define SOCKET_MAX_IOV 64 // pieces gathered into one writev()
+#define SOCKET_CHUNK_SIZE 16384 // small packets are copied into send chunks this big
+#define SOCKET_SEND_HIGHWATER (8*1024*1024) // past this much queued output we stop taking optional traffic (Writable() is false)
+#define SOCKET_SEND_LIMIT (32*1024*1024) // past this Send() refuses packets outright
+#define SOCKET_CONNECT_TIMEOUT 10 // secs a nonblocking connect gets before we give up on it
+
+class Listener;
+class SocketShard;
+struct PeerStats;
 
 class NetAddress
 {
@@ -93,15 +110,35 @@ class Socket : public Mutex
 {
 public:
 	typedef std::map<int, Socket *> SocketMap;
+	typedef std::map<int, Listener *> ListenerMap;
 
 	static void Slice( int u_sleep );
+	static void StartIOThreads( int count ); // run the reactor on count threads, sockets are spread over them as they show up
+	static int NextShard();
+	
+	static void AddListener( Listener *listener );
+	static void RemoveListener( Listener *listener );
+	
 	static const NetAddress &LocalAddr() { return _LocalAddr; }
+	
+	// Peers is shared by every I/O thread, nothing touches it but these
+	static Socket *FindPeer( const NetAddress &addr );
+	static void SetPeer( const NetAddress &addr, Socket *sock );
+	static void DropPeer( const NetAddress &addr );
+	static int PeerCount();
+	static std::vector<Peer> PeerList(); // a copy, to walk without holding the lock
 
 	Socket();
 	virtual ~Socket();
 
 	int FD() const { return _Socket; }
 	virtual const NetAddress &Addr() const { return _Addr; }
+	
+	void Pin( int shard ); // pick the I/O thread that owns us, only before Attach() or Connect()
+	int Shard() const { return _Shard; }
+	
+	virtual int MaxFrame() const { return _MaxFrame; } // largest packet the peer said it will take
+	virtual int Protocol() const { return _Protocol; } // wire format version the peer speaks
 
 	bool Connect( sockaddr_in addr, bool nonblocking = true );
 	bool Connect( NetAddress na, bool nonblocking = true );
@@ -112,31 +149,113 @@ public:
 
 	virtual void OnConnect();
 	virtual void OnAccepted();
-	virtual void Send( Packet &p );
+	// both return false, and drop the packet, if the peer is so far behind that we're past SOCKET_SEND_LIMIT
+	virtual bool Send( Packet &p );
+	virtual bool Send( Packet &p, SharedBuffer *data, int offset, int size ); // p followed by data[offset..offset+size) as its payload, data is referenced, not copied
+	
+	bool Writable() const { return _Queued < SOCKET_SEND_HIGHWATER; } // false while the send queue is over the high water mark
+	int Queued() const { return _Queued; }
 	virtual bool OnReceive( PacketReader &reader );
 	virtual void OnDisconnect();
 	
 private:
+	friend class SocketShard;
+	
+	// a piece of the send queue, either one of our own chunks that packets get copied into
+	// or a slice of someone else's buffer (file data) that we just hold a reference to
+	struct SendSegment
+	{
+		SharedBuffer *buf;
+		int offset, size;
+		bool owned;
+	};
+	typedef std::deque<SendSegment> SendQueue;
+	
+	class ConnectTimer : public Timer
+	{
+	public:
+		explicit ConnectTimer( Socket *sock ) : _Sock( sock ) {}
+		
+	protected:
+		virtual void OnTimer();
+		
+	private:
+		Socket *_Sock;
+	};
+	
 	bool DoRecv();
 	bool DoSend();
+	
+	bool ParseFrames(); // hand every whole frame in the read buffer to OnReceive(), then make room for the next one
+	
+	bool HasOutput() const { return !_SendQueue.empty(); }
+	void Append( const char *data, int len ); // copy onto the tail of the queue, must be locked
+	void Consume( int len ); // drop len sent bytes off the front of the queue, must be locked
+	
+	void Watch( bool write ); // (re)arm our epoll registration, write interest only while output is pending
+
+	static SocketShard *GetShard( int i );
+	static Listener *FindListener( int fd );
 
-	static SocketMap _Map;
+	static std::vector<SocketShard *> _Shards;
+	static ListenerMap _Listeners;
 	static Mutex _GlobalMutex;
+	static Mutex _PeerMutex; // guards Peers
 	static NetAddress _LocalAddr;
+	static bool _Threaded;
+	static unsigned int _NextShard;
 
 	NetAddress _Addr;
-	char *_SendBuff;
-	char *_RecvBuff;
-	int _SBLen, _RBLen;
-	int _SBEnd;
-	int _SBPos, _RBPos;
+	SharedBuffer *_RecvBuff; // readers borrow frames out of this, so we only rewind it while nobody else holds it
+	int _RBStart, _RBEnd; // unparsed data
+	
+	SendQueue _SendQueue;
+	int _SendHead; // how much of _SendQueue.front() is already out
+	int _Queued; // unsent bytes in _SendQueue
 	
 	int _BytesThisSec;
 
 	int _Socket;
 	int _ThisSec;
+	int _Shard;
+	int _MaxFrame;
+	int _Protocol;
+	
+	PeerStats *_Stats; // follows _Addr around
+	
+	ConnectTimer _ConnectTimer;
 
 	bool _Connecting;
+	bool _WantWrite;
+};
+
+// One epoll set and the sockets pinned to it. Until Socket::StartIOThreads() is called there is
+// a single shard and Socket::Slice() runs it from the main loop.
+class SocketShard : public Thread, public Mutex
+{
+public:
+	SocketShard();
+	virtual ~SocketShard();
+	
+	int PollFD() const { return _Poll; }
+	
+	void Slice( int u_timeout );
+	
+	void Add( Socket *sock );
+	void Remove( Socket *sock );
+	Socket *Find( int fd );
+	int AnyFD();
+	
+	void Throttle( int fd );
+	
+private:
+	virtual int ThreadMain();
+	
+	Socket::SocketMap _Sockets;
+	std::vector<int> _Throttled; // sockets that hit SOCKET_BW_LIMIT and need a kick next second
+	int _Poll;
+	int _LastSec;
+	bool _Running;
 };
 
 class LoopbackSocket : public Socket
@@ -157,11 +276,20 @@ public:
 	virtual void OnDisconnect(){}
 	
 	virtual const NetAddress &Addr() const { return Socket::LocalAddr(); }
+	virtual int MaxFrame() const { return PACKET_MAX_LENGTH; }
+	virtual int Protocol() const { return PROTOCOL_VERSION; }
 
-	virtual void Send( Packet &p )
+	virtual bool Send( Packet &p )
 	{
 		PacketReader reader = p.MakeReader();
 		OnReceive( reader );
+		return true;
+	}
+	
+	virtual bool Send( Packet &p, SharedBuffer *data, int offset, int size )
+	{
+		p.WriteRaw( data->Data() + offset, size );
+		return Send( p );
 	}
 	
 private:
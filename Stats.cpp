@@ -0,0 +1,362 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <fstream>
+#include <sstream>
+using namespace std;
+
+#include "Buddy.h"
+#include "Packet.h"
+#include "Stats.h"
+
+Histogram *Stats::_Requests[256];
+Histogram *Stats::_Served[256];
+unsigned int Stats::_Timeouts[256];
+unsigned int Stats::_Misses[256];
+Stats::PeerStatsMap Stats::_Peers;
+Mutex Stats::_Mutex;
+time_t Stats::_Started = time(NULL);
+time_t Stats::_LastDump = 0;
+
+static const char *CommandNames[] = { "NOTHING", "IN_PORT", "HANDSHAKE", "HANDSHAKE_RESP", "LOCAL_FILES", "PING", "PONG", "LIST_REQ",
+	"LIST_RESP", "CREATE_REQ", "CREATE_RESP", "FS_REQ", "FS_RESP", "OPEN_REQ", "OPEN_RESP", "READ_REQ",
+	"DATA_BLOCK", "FILE_UPDATE", "RM_DIR", "RM_FILE", "FORWARD_REQ", "DRM_REQ", "DRM_RESP", "RENAME",
+	"UPDATE_DRM", "MAKE_ALPHA", "ALPHA_CHUNK", "LEASE_BREAK" };
+
+Histogram::Histogram() : _Count( 0 ), _Max( 0 ), _Sum( 0 )
+{
+	memset( _Buckets, 0, sizeof(_Buckets) );
+}
+
+int Histogram::Bucket( unsigned int val )
+{
+	if ( val < HIST_SUB_BUCKETS )
+		return val;
+
+	int e = 31 - __builtin_clz( val ); // top bit, at least HIST_SUB_BITS
+	int sub = ( val >> ( e - HIST_SUB_BITS ) ) & ( HIST_SUB_BUCKETS - 1 );
+
+	return HIST_SUB_BUCKETS + ( e - HIST_SUB_BITS ) * HIST_SUB_BUCKETS + sub;
+}
+
+unsigned int Histogram::BucketTop( int bucket )
+{
+	if ( bucket < HIST_SUB_BUCKETS )
+		return bucket;
+
+	int e = ( bucket - HIST_SUB_BUCKETS ) / HIST_SUB_BUCKETS + HIST_SUB_BITS;
+	int sub = ( bucket - HIST_SUB_BUCKETS ) % HIST_SUB_BUCKETS;
+	unsigned int width = 1u << ( e - HIST_SUB_BITS );
+
+	return (unsigned int)( HIST_SUB_BUCKETS + sub ) * width + ( width - 1 );
+}
+
+void Histogram::Record( unsigned int usecs )
+{
+	__sync_fetch_and_add( &_Buckets[ Bucket( usecs ) ], 1 );
+	__sync_fetch_and_add( &_Count, 1 );
+	__sync_fetch_and_add( &_Sum, (unsigned long long)usecs );
+
+	unsigned int max = _Max;
+	while ( usecs > max && !__sync_bool_compare_and_swap( &_Max, max, usecs ) )
+		max = _Max;
+}
+
+unsigned int Histogram::Percentile( double pct ) const
+{
+	// the buckets keep moving while we look, so this is only as exact as a snapshot can be
+	unsigned int count = _Count;
+	unsigned int want = (unsigned int)( count * pct / 100.0 + 0.999999 );
+	unsigned int seen = 0;
+
+	if ( want == 0 )
+		want = 1;
+
+	for ( int i = 0; i < HIST_BUCKETS; i++ )
+	{
+		seen += _Buckets[i];
+
+		if ( seen >= want )
+			return BucketTop( i ) < _Max ? BucketTop( i ) : _Max;
+	}
+
+	return _Max;
+}
+
+
+
+Histogram *Stats::Get( Histogram **table, int cmd )
+{
+	Histogram *h = table[ cmd & 0xFF ];
+
+	if ( h == NULL )
+	{
+		h = new Histogram();
+
+		if ( !__sync_bool_compare_and_swap( &table[ cmd & 0xFF ], (Histogram *)NULL, h ) )
+		{
+			delete h; // someone beat us to it
+			h = table[ cmd & 0xFF ];
+		}
+	}
+
+	return h;
+}
+
+unsigned int Stats::Since( const timeval &start )
+{
+	timeval now;
+	gettimeofday( &now, NULL );
+
+	long long usecs = (long long)( now.tv_sec - start.tv_sec ) * 1000000 + ( now.tv_usec - start.tv_usec );
+
+	if ( usecs < 0 )
+		return 0;
+	if ( usecs > 0xFFFFFFFFll )
+		return 0xFFFFFFFF;
+
+	return (unsigned int)usecs;
+}
+
+void Stats::Request( int cmd, const timeval &sent )
+{
+	Get( _Requests, cmd )->Record( Since( sent ) );
+}
+
+void Stats::Timeout( int cmd )
+{
+	__sync_fetch_and_add( &_Timeouts[ cmd & 0xFF ], 1 );
+}
+
+void Stats::Serve( int cmd, const timeval &start )
+{
+	Get( _Served, cmd )->Record( Since( start ) );
+}
+
+void Stats::Miss( int cmd )
+{
+	__sync_fetch_and_add( &_Misses[ cmd & 0xFF ], 1 );
+}
+
+PeerStats *Stats::Peer( const NetAddress &addr )
+{
+	_Mutex.Lock();
+
+	PeerStatsMap::iterator iter = _Peers.find( addr );
+	PeerStats *ps;
+
+	if ( iter != _Peers.end() )
+	{
+		ps = iter->second;
+	}
+	else
+	{
+		ps = new PeerStats();
+		memset( ps, 0, sizeof(PeerStats) );
+		_Peers.insert( PeerStatsMap::value_type( addr, ps ) );
+	}
+
+	_Mutex.Unlock();
+
+	return ps;
+}
+
+const char *Stats::CommandName( int cmd )
+{
+	if ( cmd >= 0 && cmd < (int)( sizeof(CommandNames)/sizeof(CommandNames[0]) ) )
+		return CommandNames[cmd];
+
+	return "UNKNOWN";
+}
+
+void Stats::Slice()
+{
+	if ( _LastDump + STATS_DUMP_INTERVAL < time(NULL) )
+		Dump();
+}
+
+void Stats::Dump()
+{
+	char fileName[MAX_PATH], tempName[MAX_PATH];
+
+	_LastDump = time(NULL);
+
+	// written to the side and renamed into place, so a scraper never sees half a file
+	sprintf( fileName, "%s/stats", BuddyDir );
+	sprintf( tempName, "%s/stats.tmp", BuddyDir );
+
+	ofstream text( tempName, ios::out|ios::trunc );
+	if ( text )
+	{
+		WriteText( text );
+		text.close();
+		rename( tempName, fileName );
+	}
+
+	sprintf( fileName, "%s/stats.json", BuddyDir );
+	sprintf( tempName, "%s/stats.json.tmp", BuddyDir );
+
+	ofstream json( tempName, ios::out|ios::trunc );
+	if ( json )
+	{
+		WriteJSON( json );
+		json.close();
+		rename( tempName, fileName );
+	}
+}
+
+string Stats::Text()
+{
+	ostringstream out;
+
+	WriteText( out );
+
+	return out.str();
+}
+
+void Stats::WriteText( ostream &out )
+{
+	out << "uptime " << time(NULL) - _Started << endl;
+
+	Histogram **tables[2] = { _Requests, _Served };
+	const char *titles[2] = { "requests (usecs until the first response)", "served (usecs to answer)" };
+
+	for ( int t = 0; t < 2; t++ )
+	{
+		out << titles[t] << ":" << endl;
+
+		for ( int i = 0; i < 256; i++ )
+		{
+			Histogram *h = tables[t][i];
+
+			if ( h == NULL && ( t != 0 || _Timeouts[i] == 0 ) )
+				continue;
+
+			out << "  " << CommandName( i );
+
+			if ( h )
+			{
+				out << " count " << h->Count() << " mean " << (unsigned int)h->Mean() << " p50 " << h->Percentile( 50 )
+					<< " p90 " << h->Percentile( 90 ) << " p99 " << h->Percentile( 99 ) << " max " << h->Max();
+			}
+
+			if ( t == 0 )
+				out << " timeouts " << _Timeouts[i];
+
+			out << endl;
+		}
+	}
+
+	out << "dispatch misses:" << endl;
+
+	for ( int i = 0; i < 256; i++ )
+	{
+		if ( _Misses[i] )
+			out << "  " << CommandName( i ) << " " << _Misses[i] << endl;
+	}
+
+	out << "peers:" << endl;
+
+	_Mutex.Lock();
+	for ( PeerStatsMap::iterator iter = _Peers.begin(); iter != _Peers.end(); iter++ )
+	{
+		PeerStats *ps = iter->second;
+
+		out << "  " << iter->first << " in " << ps->bytesIn << " bytes " << ps->packetsIn << " packets, out "
+			<< ps->bytesOut << " bytes " << ps->packetsOut << " packets" << endl;
+	}
+	_Mutex.Unlock();
+}
+
+void Stats::WriteJSON( ostream &out )
+{
+	out << "{\"uptime\":" << time(NULL) - _Started;
+
+	Histogram **tables[2] = { _Requests, _Served };
+	const char *keys[2] = { "requests", "served" };
+
+	for ( int t = 0; t < 2; t++ )
+	{
+		bool first = true;
+
+		out << ",\"" << keys[t] << "\":{";
+
+		for ( int i = 0; i < 256; i++ )
+		{
+			Histogram *h = tables[t][i];
+
+			if ( h == NULL && ( t != 0 || _Timeouts[i] == 0 ) )
+				continue;
+
+			out << ( first ? "" : "," ) << "\"" << CommandName( i ) << "\":{";
+			first = false;
+
+			if ( h )
+			{
+				out << "\"count\":" << h->Count() << ",\"mean\":" << (unsigned int)h->Mean() << ",\"p50\":" << h->Percentile( 50 )
+					<< ",\"p90\":" << h->Percentile( 90 ) << ",\"p99\":" << h->Percentile( 99 ) << ",\"max\":" << h->Max();
+			}
+			else
+			{
+				out << "\"count\":0";
+			}
+
+			if ( t == 0 )
+				out << ",\"timeouts\":" << _Timeouts[i];
+
+			out << "}";
+		}
+
+		out << "}";
+	}
+
+	bool first = true;
+
+	out << ",\"misses\":{";
+
+	for ( int i = 0; i < 256; i++ )
+	{
+		if ( _Misses[i] )
+		{
+			out << ( first ? "" : "," ) << "\"" << CommandName( i ) << "\":" << _Misses[i];
+			first = false;
+		}
+	}
+
+	out << "},\"peers\":{";
+
+	first = true;
+
+	_Mutex.Lock();
+	for ( PeerStatsMap::iterator iter = _Peers.begin(); iter != _Peers.end(); iter++ )
+	{
+		PeerStats *ps = iter->second;
+
+		out << ( first ? "" : "," ) << "\"" << iter->first << "\":{\"bytes_in\":" << ps->bytesIn << ",\"bytes_out\":" << ps->bytesOut
+			<< ",\"packets_in\":" << ps->packetsIn << ",\"packets_out\":" << ps->packetsOut << "}";
+		first = false;
+	}
+	_Mutex.Unlock();
+
+	out << "}}" << endl;
+}
@@ -0,0 +1,104 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <map>
+#include <string>
+#include <ostream>
+#include <sys/time.h>
+
+#include "Mutex.h"
+#include "Socket.h"
+
+#define HIST_SUB_BITS 4 // 16 buckets per power of two, so a bucket is within about 6% of what went in it
+#define HIST_SUB_BUCKETS ( 1 << HIST_SUB_BITS )
+#define HIST_BUCKETS ( HIST_SUB_BUCKETS + ( 32 - HIST_SUB_BITS ) * HIST_SUB_BUCKETS ) // covers all of 32 bits worth of usecs
+
+#define STATS_DUMP_INTERVAL 10 // secs between writes of BuddyDir/stats and stats.json
+
+// log linear histogram of usecs in the spirit of HdrHistogram: values under 16 get a bucket each, after that
+// every power of two is split into 16. recording is a couple of atomic adds, no locks.
+class Histogram
+{
+public:
+	Histogram();
+
+	void Record( unsigned int usecs );
+
+	unsigned int Count() const { return _Count; }
+	unsigned int Max() const { return _Max; }
+	double Mean() const { return _Count ? double( _Sum ) / _Count : 0; }
+	unsigned int Percentile( double pct ) const; // upper edge of the bucket the pct'th value landed in
+
+private:
+	static int Bucket( unsigned int val );
+	static unsigned int BucketTop( int bucket );
+
+	unsigned int _Buckets[HIST_BUCKETS];
+	unsigned int _Count, _Max;
+	unsigned long long _Sum;
+};
+
+struct PeerStats
+{
+	unsigned long long bytesIn, bytesOut;
+	unsigned long long packetsIn, packetsOut;
+};
+
+// counters for the whole node. everything is indexed by command and allocated on first use, the
+// per peer counters are never freed so a Socket can keep a pointer to its own.
+class Stats
+{
+public:
+	static void Request( int cmd, const timeval &sent ); // a response to cmd came in for a request sent at sent
+	static void Timeout( int cmd ); // a request waiting on cmd gave up with nothing
+	static void Serve( int cmd, const timeval &start ); // we finished handling an incoming cmd that arrived at start
+	static void Miss( int cmd ); // no clique took a packet
+
+	static PeerStats *Peer( const NetAddress &addr );
+	static void Count( unsigned long long &counter, unsigned long long n ) { __sync_fetch_and_add( &counter, n ); }
+
+	static void Slice(); // writes the dump files every STATS_DUMP_INTERVAL secs
+	static void Dump();
+
+	static void WriteText( std::ostream &out );
+	static void WriteJSON( std::ostream &out );
+	static std::string Text(); // WriteText() into a string, for handing out through the mount
+
+	static const char *CommandName( int cmd );
+
+private:
+	typedef std::map<NetAddress, PeerStats *> PeerStatsMap;
+
+	static Histogram *Get( Histogram **table, int cmd );
+	static unsigned int Since( const timeval &start );
+
+	static Histogram *_Requests[256]; // round trip, by the command we were waiting on
+	static Histogram *_Served[256]; // time spent answering, by the command that came in
+	static unsigned int _Timeouts[256];
+	static unsigned int _Misses[256];
+
+	static PeerStatsMap _Peers;
+	static Mutex _Mutex;
+	static time_t _Started, _LastDump;
+};
+
+#endif
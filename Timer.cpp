@@ -0,0 +1,270 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <time.h>
+
+#include "Timer.h"
+
+#define TIMER_MASK ( TIMER_SLOTS - 1 )
+#define TIMER_RANGE ( 1u << ( TIMER_LEVELS * TIMER_SLOT_BITS ) ) // ticks the wheel can see ahead
+
+Mutex TimerWheel::_Mutex;
+Mutex TimerWheel::_Running;
+pthread_cond_t TimerWheel::_Done = PTHREAD_COND_INITIALIZER;
+TimerLink TimerWheel::_Slots[TIMER_LEVELS][TIMER_SLOTS];
+unsigned int TimerWheel::_Tick = 0;
+int TimerWheel::_Count = 0;
+bool TimerWheel::_Started = false;
+Timer *TimerWheel::_Firing = NULL;
+pthread_t TimerWheel::_FiringThread;
+
+Timer::Timer() : _Due( 0 )
+{
+	prev = next = NULL;
+}
+
+Timer::~Timer()
+{
+	Cancel();
+}
+
+void Timer::Schedule( int msecs )
+{
+	if ( msecs < 0 )
+		msecs = 0;
+	
+	TimerWheel::_Mutex.Lock();
+	
+	if ( next )
+	{
+		TimerWheel::Unlink( this );
+		TimerWheel::_Count--;
+	}
+	
+	// the current tick is already partly gone, so round up a whole extra one rather than go off early
+	_Due = TimerWheel::Now() + ( msecs + TIMER_TICK - 1 ) / TIMER_TICK + 1;
+	TimerWheel::Insert( this );
+	
+	TimerWheel::_Mutex.Unlock();
+}
+
+void Timer::Cancel()
+{
+	TimerWheel::_Mutex.Lock();
+	
+	if ( next )
+	{
+		TimerWheel::Unlink( this );
+		TimerWheel::_Count--;
+	}
+	
+	// if it's going off on another thread right now wait it out, from inside OnTimer() we just return
+	while ( TimerWheel::_Firing == this && !pthread_equal( TimerWheel::_FiringThread, pthread_self() ) )
+		pthread_cond_wait( &TimerWheel::_Done, TimerWheel::_Mutex.Handle() );
+	
+	TimerWheel::_Mutex.Unlock();
+}
+
+bool Timer::Pending()
+{
+	TimerWheel::_Mutex.Lock();
+	bool pending = next != NULL;
+	TimerWheel::_Mutex.Unlock();
+	
+	return pending;
+}
+
+
+
+void TimerWheel::Advance()
+{
+	if ( !_Running.TryLock() )
+		return;
+	
+	_Mutex.Lock();
+	
+	unsigned int now = Now();
+	
+	if ( !_Started || _Count == 0 )
+	{
+		// nothing to catch up on, don't spin through the ticks we slept through
+		if ( !_Started )
+			Insert( NULL );
+		
+		_Tick = now + 1;
+	}
+	
+	TimerLink expired;
+	expired.prev = expired.next = &expired;
+	
+	while ( (int)( now - _Tick ) >= 0 )
+	{
+		int slot = _Tick & TIMER_MASK;
+		
+		// coming back around to slot 0 moves the next turn's worth of timers down from the level above
+		for ( int level = 1; slot == 0 && level < TIMER_LEVELS; level++ )
+		{
+			slot = ( _Tick >> ( level * TIMER_SLOT_BITS ) ) & TIMER_MASK;
+			Cascade( level, slot );
+		}
+		
+		TimerLink &head = _Slots[0][ _Tick & TIMER_MASK ];
+		if ( head.next != &head )
+		{
+			expired.next = head.next;
+			expired.prev = head.prev;
+			expired.next->prev = &expired;
+			expired.prev->next = &expired;
+			head.prev = head.next = &head;
+		}
+		
+		_Tick++;
+		
+		// one at a time, OnTimer() may well cancel or reschedule the others
+		while ( expired.next != &expired )
+		{
+			Timer *t = static_cast<Timer*>( expired.next );
+			
+			Unlink( t );
+			_Count--;
+			
+			_Firing = t;
+			_FiringThread = pthread_self();
+			_Mutex.Unlock();
+			
+			t->OnTimer(); // t may be gone after this
+			
+			_Mutex.Lock();
+			_Firing = NULL;
+			pthread_cond_broadcast( &_Done );
+		}
+	}
+	
+	_Mutex.Unlock();
+	_Running.Unlock();
+}
+
+int TimerWheel::NextTimeout( int u_max )
+{
+	_Mutex.Lock();
+	
+	if ( !_Started || _Count == 0 )
+	{
+		_Mutex.Unlock();
+		return u_max;
+	}
+	
+	// the next timer on the bottom level, or the next time it wraps and pulls more down, whichever is first
+	int ticks = ( TIMER_SLOTS - ( _Tick & TIMER_MASK ) ) & TIMER_MASK; // slot 0 is where the wrap happens
+	
+	for ( int i = 0; i < ticks; i++ )
+	{
+		TimerLink &head = _Slots[0][ ( _Tick + i ) & TIMER_MASK ];
+		if ( head.next != &head )
+		{
+			ticks = i;
+			break;
+		}
+	}
+	
+	int behind = (int)( Now() - _Tick );
+	
+	_Mutex.Unlock();
+	
+	int usecs = ( ticks - behind ) * TIMER_TICK * 1000;
+	
+	if ( usecs < 0 )
+		usecs = 0;
+	
+	return usecs < u_max ? usecs : u_max;
+}
+
+unsigned int TimerWheel::Now()
+{
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	
+	return (unsigned int)( ts.tv_sec * ( 1000 / TIMER_TICK ) + ts.tv_nsec / ( TIMER_TICK * 1000000 ) );
+}
+
+void TimerWheel::Insert( Timer *t )
+{
+	if ( !_Started )
+	{
+		for ( int i = 0; i < TIMER_LEVELS; i++ )
+		{
+			for ( int j = 0; j < TIMER_SLOTS; j++ )
+				_Slots[i][j].prev = _Slots[i][j].next = &_Slots[i][j];
+		}
+		
+		_Tick = Now();
+		_Started = true;
+	}
+	
+	if ( t == NULL )
+		return;
+	
+	if ( (int)( t->_Due - _Tick ) < 0 )
+		t->_Due = _Tick; // already late, goes off on the next Advance()
+	
+	unsigned int delta = t->_Due - _Tick;
+	
+	if ( delta >= TIMER_RANGE )
+	{
+		t->_Due = _Tick + TIMER_RANGE - 1;
+		delta = TIMER_RANGE - 1;
+	}
+	
+	int level = 0;
+	while ( level < TIMER_LEVELS - 1 && delta >= ( 1u << ( ( level + 1 ) * TIMER_SLOT_BITS ) ) )
+		level++;
+	
+	Append( &_Slots[level][ ( t->_Due >> ( level * TIMER_SLOT_BITS ) ) & TIMER_MASK ], t );
+	_Count++;
+}
+
+void TimerWheel::Unlink( TimerLink *link )
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->prev = link->next = NULL;
+}
+
+void TimerWheel::Append( TimerLink *head, TimerLink *link )
+{
+	link->prev = head->prev;
+	link->next = head;
+	head->prev->next = link;
+	head->prev = link;
+}
+
+void TimerWheel::Cascade( int level, int slot )
+{
+	TimerLink &head = _Slots[level][slot];
+	
+	while ( head.next != &head )
+	{
+		Timer *t = static_cast<Timer*>( head.next );
+		
+		Unlink( t );
+		_Count--;
+		
+		Insert( t );
+	}
+}
@@ -0,0 +1,91 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __TIMER_H_
+#define __TIMER_H_
+
+#include <pthread.h>
+
+#include "Mutex.h"
+
+#define TIMER_TICK 10 // msecs per tick of the wheel
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS ( 1 << TIMER_SLOT_BITS ) // slots per level
+#define TIMER_LEVELS 4 // 64 ticks, 4096, 262144, 16777216: the last level reaches out about 46 hours
+
+struct TimerLink
+{
+	TimerLink *prev, *next;
+};
+
+// something that wants to be told once some time has passed. Schedule() it, and OnTimer() gets
+// called from whichever thread drives TimerWheel::Advance() (the first socket shard), with no locks held.
+class Timer : private TimerLink
+{
+public:
+	Timer();
+	virtual ~Timer(); // cancels, so it's safe to delete a timer that might be going off right now
+	
+	void Schedule( int msecs ); // (re)arms it to go off once, msecs from now
+	void Cancel(); // once this returns OnTimer() isn't running and won't be called
+	bool Pending();
+	
+protected:
+	virtual void OnTimer() = 0;
+	
+private:
+	friend class TimerWheel;
+	
+	unsigned int _Due; // tick it goes off at
+	
+	// not copyable
+	Timer( const Timer & );
+	Timer &operator=( const Timer & );
+};
+
+// hierarchical timing wheel: each level has 64 slots, each slot of a level covers a whole turn of the one
+// below it. timers get put in the coarsest level they fit in and are moved down a level each time the
+// level below comes back around, so adding, canceling and firing a timer are all O(1).
+class TimerWheel
+{
+public:
+	static void Advance(); // fire everything that's due, only one thread does this at a time
+	static int NextTimeout( int u_max ); // usecs the caller can sleep before Advance() has anything to do, at most u_max
+	
+private:
+	friend class Timer;
+	
+	static unsigned int Now(); // current tick
+	static void Insert( Timer *t ); // must be locked
+	static void Unlink( TimerLink *link );
+	static void Append( TimerLink *head, TimerLink *link );
+	static void Cascade( int level, int slot ); // must be locked
+	
+	static Mutex _Mutex;
+	static Mutex _Running;
+	static pthread_cond_t _Done; // signaled on _Mutex when _Firing finishes
+	static TimerLink _Slots[TIMER_LEVELS][TIMER_SLOTS];
+	static unsigned int _Tick; // next tick to run
+	static int _Count;
+	static bool _Started;
+	static Timer *_Firing;
+	static pthread_t _FiringThread;
+};
+
+#endif
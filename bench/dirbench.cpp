@@ -0,0 +1,90 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// creating, looking up and listing the files of one flat folder, for each size asked for.
+// bench/dirbench [entries ...], 1000 10000 100000 1000000 by default
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Buddy.h"
+#include "../FileSystem.h"
+
+#include "bench.h"
+
+static void Run( int n, int round )
+{
+	char path[MAX_PATH];
+	char folder[32];
+	
+	sprintf( folder, "/flat%d", round ); // a fresh folder each round, the earlier ones just sit there
+	FileSystem::AddObject( folder, DT_DIR );
+	
+	double start = Now();
+	for ( int i = 0; i < n; i++ )
+	{
+		sprintf( path, "%s/f%d", folder, i );
+		FileSystem::AddObject( path, DT_REG );
+	}
+	double create = Now() - start;
+	
+	// every name once, in an order that isn't the one they were made in
+	int found = 0;
+	
+	start = Now();
+	for ( int i = 0; i < n; i++ )
+	{
+		sprintf( path, "%s/f%d", folder, (int)( ( (long long)i * 7919 ) % n ) );
+		found += FileSystem::FindObject( path ) != NULL;
+	}
+	double lookup = Now() - start;
+	
+	Folder *f = (Folder *)FileSystem::FindObject( folder );
+	long names = 0;
+	
+	start = Now();
+	for ( FSListIter iter = f->GetList().begin(); iter != f->GetList().end(); iter++ )
+		names += strlen( (*iter)->Name() );
+	double readdir = Now() - start;
+	
+	printf( "%8d  create %8.3f s %6.0f ns/op  lookup %8.3f s %6.0f ns/op  readdir %7.4f s  found %d\n",
+		n, create, create / n * 1e9, lookup, lookup / n * 1e9, readdir, found );
+	fflush( stdout );
+}
+
+int main( int argc, char **argv )
+{
+	static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+	
+	if ( argc > 1 )
+	{
+		for ( int i = 1; i < argc; i++ )
+			Run( atoi( argv[i] ), i );
+	}
+	else
+	{
+		for ( int i = 0; i < 4; i++ )
+			Run( sizes[i], i );
+	}
+	
+	// tearing the tree down isn't what's being measured
+	_exit( 0 );
+}
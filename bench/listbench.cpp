@@ -0,0 +1,84 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// how long it takes to put a big tree into a packet, the way an alpha hands it to a peer in MAKE_ALPHA.
+// bench/listbench [files] [folders]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../Buddy.h"
+#include "../FileSystem.h"
+#include "../Packet.h"
+
+#include "bench.h"
+
+int main( int argc, char **argv )
+{
+	int files = argc > 1 ? atoi( argv[1] ) : 100000;
+	int folders = argc > 2 ? atoi( argv[2] ) : 100;
+	char path[MAX_PATH];
+	
+	if ( files <= 0 || folders <= 0 )
+	{
+		fprintf( stderr, "usage: %s [files] [folders]\n", argv[0] );
+		return 1;
+	}
+	
+	for ( int i = 0; i < folders; i++ )
+	{
+		sprintf( path, "/d%d", i );
+		FileSystem::AddObject( path, DT_DIR );
+	}
+	
+	for ( int i = 0; i < files; i++ )
+	{
+		sprintf( path, "/d%d/file%d", i % folders, i );
+		FileSystem::AddObject( path, DT_REG );
+	}
+	
+	// the whole tree, with whatever reservation WriteFullList() makes for itself
+	Packet list( MAKE_ALPHA );
+	
+	double start = Now();
+	FileSystem::WriteFullList( list );
+	double tree = Now() - start;
+	
+	// the same number of entries straight into a packet that starts empty, so it's all growth
+	Packet grow( LIST_RESP );
+	
+	start = Now();
+	for ( int i = 0; i < files; i++ )
+	{
+		sprintf( path, "file%d", i );
+		grow.WriteASCII( path );
+		grow.WriteInt( DT_REG );
+		grow.WriteUnsignedInt( 0644 );
+	}
+	double append = Now() - start;
+	
+	printf( "%d files in %d folders\n", files, folders );
+	printf( "WriteFullList  %8.3f s  %9d bytes\n", tree, list.Length() );
+	printf( "appends        %8.3f s  %9d bytes\n", append, grow.Length() );
+	
+	// tearing the tree down isn't what's being measured
+	fflush( stdout );
+	_exit( 0 );
+}
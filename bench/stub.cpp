@@ -0,0 +1,59 @@
+/*
+    BuddyFS - Peer2Peer Distributed File System
+    Copyright (C) 2005  Rick Carback and Bryan Pass
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// everything Buddy.cpp and drm.cpp would otherwise bring along, so the benchmarks link against the rest of
+// the tree without a node, a mount or a key store
+
+#include <sys/time.h>
+
+#include "../Buddy.h"
+#include "../FileSystem.h"
+#include "../drm.h"
+
+#include "bench.h"
+
+unsigned short LocalPort = 5000;
+const char *BuddyDir = "/tmp";
+PeerMap Peers;
+AlphaClique Alpha;
+DRM *DRMManager = NULL;
+
+Socket *FindPeer( const NetAddress &addr )
+{
+	PeerMap::iterator iter = Peers.find( addr );
+	
+	return iter == Peers.end() ? NULL : iter->second;
+}
+
+// nothing here is ever encrypted
+void DRM::ReadDRM( FSObject *fsobj, PacketReader &reader ) {}
+void DRM::WriteDRM( FSObject *fsobj, Packet &p ) {}
+void DRM::Encrypt( File *file, Packet &p ) {}
+void DRM::Decrypt( File *file, PacketReader &reader ) {}
+bool DRM::CanWrite( FSObject *fsobj ) { return true; }
+bool DRM::CanAppend( FSObject *fsobj ) { return true; }
+
+double Now()
+{
+	timeval now;
+	
+	gettimeofday( &now, NULL );
+	
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
@@ -32,6 +32,7 @@
 #include "Buddy.h"
 #include "FileSystem.h"
 #include "drm.h"
+#include "Log.h"
 
 using namespace std;
 
@@ -129,7 +130,7 @@ DRM::DRM()
 	sprintf( temp, "%s/drm.conf", BuddyDir );
 	ifstream file( temp );
 	if ( !file )
-		cout << "Unable to open " << temp << ": " << strerror(errno) << endl;
+		LOG( LOG_WARN, "Unable to open " << temp << ": " << strerror(errno) );
 	//Default Values
 	_Curr = NULL;
 	_Default = new Rights;
@@ -178,7 +179,7 @@ DRM::DRM()
 				
 				AddUser(userpass[0], userpass[1]);
 				
-				cout << "Added User " << userpass[0] << endl;
+				LOG( LOG_INFO, "Added User " << userpass[0] );
 				
 				getline(file, rhs);
 			}
@@ -205,7 +206,7 @@ DRM::DRM()
 				
 				groups.push_back(newgrp);
 				
-				cout << "Added Group " << gname[0] << endl;
+				LOG( LOG_INFO, "Added Group " << gname[0] );
 				
 				getline(file, rhs);
 			}
@@ -216,7 +217,7 @@ DRM::DRM()
 			
 			_Default->ownerperms = atoi(rhs.c_str());
 			
-			cout << "Set ownerperms to " << rhs << endl;
+			LOG( LOG_INFO, "Set ownerperms to " << rhs );
 		}
 		else if (lhs == "[owners]" || lhs == "[defaultgroups]")
 		{
@@ -237,7 +238,7 @@ DRM::DRM()
 				{
 					_Default->owners.push_back(GetUser(list[i]));
 					
-					cout << "Set owner " << list[i] << endl;
+					LOG( LOG_INFO, "Set owner " << list[i] );
 				}
 				else if (lhs == "[defaultgroups]")
 				{
@@ -247,7 +248,7 @@ DRM::DRM()
 					if (g != NULL)
 						_Default->groups[g] = atoi(grp[1].c_str());
 						
-					cout << "Set group " << g->group_name << endl;
+					LOG( LOG_INFO, "Set group " << g->group_name );
 				}
 			}
 		}
@@ -257,7 +258,7 @@ DRM::DRM()
 			
 			_Default->others = atoi(rhs.c_str());
 			
-			cout << "Set others perms to " << rhs << endl;
+			LOG( LOG_INFO, "Set others perms to " << rhs );
 		}
 		else if (lhs == "order")
 		{
@@ -266,7 +267,7 @@ DRM::DRM()
 			if (rhs == "deny") _Default->order_deny_allow = true;
 			else _Default->order_deny_allow = false;
 			
-			cout << "Set order bit to " << rhs << endl;
+			LOG( LOG_INFO, "Set order bit to " << rhs );
 		}
 		else if (lhs == "[allowed]" || lhs == "[denied]")
 		{
@@ -278,7 +279,7 @@ DRM::DRM()
 			{
 				addresses.push_back(NetAddress(inet_addr(rhs.c_str()), 0));
 				
-				cout << "Picked up address " << rhs << endl;
+				LOG( LOG_INFO, "Picked up address " << rhs );
 				
 				getline(file, rhs);
 			}
@@ -286,12 +287,12 @@ DRM::DRM()
 			if (lhs == "[allowed]")
 			{
 				_Default->allowed_sites = addresses;
-				cout << "Set to allowed" << endl;
+				LOG( LOG_INFO, "Set to allowed" );
 			}
 			else
 			{
 				_Default->denied_sites = addresses;
-				cout << "Set to denied" << endl;
+				LOG( LOG_INFO, "Set to denied" );
 			}
 		}
 		else if (lhs == "allowapps")
@@ -301,7 +302,7 @@ DRM::DRM()
 			if (rhs == "no") _Default->allow_all_apps = false;
 			else _Default->allow_all_apps = true;
 			
-			cout << "Set allowapps bit to " << rhs << endl;
+			LOG( LOG_INFO, "Set allowapps bit to " << rhs );
 		}
 		else if (lhs == "[apps]")
 		{
@@ -316,16 +317,18 @@ DRM::DRM()
 				
 				apps.push_back( hash );
 				
-				cout << "Picked up app " << hash.ToString() << endl;
+				LOG( LOG_INFO, "Picked up app " << hash.ToString() );
 				
 				getline(file, rhs);
 			}
 			
-			cout << "Setting apps" << endl;
+			LOG( LOG_INFO, "Setting apps" );
 			_Default->allowed_applications = apps;
 		}
 	}
 
+	Log::Flush(); // get the config chatter out of the way before we prompt
+	
 	while ( _Curr == NULL )
 	{
 		cout << endl << "Enter BuddyFS username: ";
@@ -977,22 +980,22 @@ int DRM::GetPerms(FSObject *fsobj)
 		}
 		
 		int perms = file_rights.others;
-		cout << "Checking groups..." << endl;
+		LOG( LOG_DEBUG, "Checking groups..." );
 		//Sum all possible rights to the file
 		for (unsigned int i = 0; i < _CurrGroups.size(); i++)
 		{			
-			cout << "Checking group " << _CurrGroups[i]->group_name << endl;
+			LOG( LOG_DEBUG, "Checking group " << _CurrGroups[i]->group_name );
 			//If file gives perm to that group...
 			GroupMap::iterator iter = file_rights.groups.find( _CurrGroups[i] );
 			if ( iter != file_rights.groups.end() )
 			{
-				cout << "Old: " << perms << ", given " << iter->second;
+				int old = perms;
 				perms = AddPerms(perms, iter->second);
-				cout << ", new " << perms << endl;
+				LOG( LOG_DEBUG, "Old: " << old << ", given " << iter->second << ", new " << perms );
 			}
 			else
 			{
-				cout << "NEGATIVE!" << endl;
+				LOG( LOG_DEBUG, "NEGATIVE!" );
 			}
 		}
 		
@@ -1167,7 +1170,7 @@ void DRM::Encrypt(File *file, Packet &p)
 		
 		if ( bytes_read == 0 ) 
 		{
-			cerr << "Reading Error in encryption!" << endl;
+			LOG( LOG_ERROR, "Reading Error in encryption!" );
 			EVP_CIPHER_CTX_cleanup( &context );
 			return;
 		} 
@@ -1179,7 +1182,7 @@ void DRM::Encrypt(File *file, Packet &p)
 		out_len = 1032;
 		if ( !EVP_EncryptUpdate(&context, out_buffer, &out_len, in_buffer, bytes_read) )
 		{
-			cerr << "Error in encrypt update!" << endl;
+			LOG( LOG_ERROR, "Error in encrypt update!" );
 			EVP_CIPHER_CTX_cleanup( &context );
 			return;
 		}
@@ -1196,7 +1199,7 @@ void DRM::Encrypt(File *file, Packet &p)
 	out_len = 1032;
 	if ( !EVP_EncryptFinal(&context, out_buffer, &out_len) )
 	{
-		cerr << "Error in Final Encrypt!" << endl;
+		LOG( LOG_ERROR, "Error in Final Encrypt!" );
 		return;
 	}
 	
@@ -1233,7 +1236,7 @@ void DRM::Decrypt(File *file, PacketReader &reader)
 		
 		if (!reader.ReadRaw(in_buffer, in_len))
 		{
-			cerr << "Reading error during decryption!" << endl;
+			LOG( LOG_ERROR, "Reading error during decryption!" );
 			EVP_CIPHER_CTX_cleanup( &context );
 			return;
 		}
@@ -1242,7 +1245,7 @@ void DRM::Decrypt(File *file, PacketReader &reader)
 		out_len = 1024;
 		if (!EVP_DecryptUpdate(&context, out_buffer, &out_len, in_buffer, in_len))
 		{
-			cerr << "Error in decrypt update!" << endl;
+			LOG( LOG_ERROR, "Error in decrypt update!" );
 			EVP_CIPHER_CTX_cleanup( &context );
 			return;
 		}
@@ -1257,7 +1260,7 @@ void DRM::Decrypt(File *file, PacketReader &reader)
 	out_len = 1024;
 	if ( !EVP_DecryptFinal(&context, out_buffer, &out_len) )
 	{
-		cerr << "Error in decrypt final!" << endl;
+		LOG( LOG_ERROR, "Error in decrypt final!" );
 		return;
 	}
 	